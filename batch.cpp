@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "batch.h"
+#include "compare.h"
+#include "driver_state.h"
+#include "dump_png.h"
+#include "shaders.h"
+#include "trace.h"
+
+void parse(const char* test_file, driver_state& state);
+
+namespace
+{
+    // One line of the manifest, along with the outcome of running it.
+    struct batch_test
+    {
+        double points = 0;
+        double max_error = 0;
+        double max_time = 0;
+        std::string name;
+
+        // The run-wide settings with the options of this test applied, and
+        // those options as written, to tell apart tests of the same scene.
+        render_config config;
+        std::string options;
+
+        bool size_mismatch = false;
+        compare_result result;
+        double render_ms = 0;
+    };
+
+    // Render one test into state and compare it with its reference image.
+    void run_test(const std::string& dir, batch_test& test, driver_state& state)
+    {
+        TRACE_SCOPE("batch_test");
+
+        std::string scene = dir + test.name + ".txt";
+        std::string solution = dir + test.name + ".png";
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        parse(scene.c_str(), state);
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        test.render_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+        int width_sol = 0;
+        int height_sol = 0;
+        pixel* image_sol = 0;
+        read_png(image_sol, width_sol, height_sol, solution.c_str());
+        if(state.image_width!=width_sol || state.image_height!=height_sol)
+            test.size_mismatch = true;
+        else
+            test.result = compare_images(image_sol, state.image_color,
+                (long)width_sol*height_sol, 1);
+        delete [] image_sol;
+    }
+
+    // Worker thread: claim tests one at a time until none are left.
+    void run_worker(const std::string& dir, std::vector<batch_test>& tests, std::atomic<size_t>& next)
+    {
+        driver_state state;
+        for(size_t i = next++; i < tests.size(); i = next++)
+        {
+            state.config = tests[i].config;
+
+            // The tests themselves already run in parallel.
+            state.config.threads = 1;
+            run_test(dir, tests[i], state);
+        }
+    }
+
+    // Apply the render options that follow the test file on a manifest line,
+    // such as "-M" or "-D unorm24", to test.config.  Returns false if one is
+    // not among RENDER_CONFIG_OPTIONS or has a bad argument.
+    bool parse_test_options(std::stringstream& ss, batch_test& test)
+    {
+        std::string option, arg;
+        while(ss>>option)
+        {
+            const char* spec = option.size() == 2 && option[0] == '-' ? strchr(RENDER_CONFIG_OPTIONS, option[1]) : 0;
+            if(!spec || option[1] == ':') return false;
+            test.options += " " + option;
+            arg.clear();
+            if(spec[1] == ':')
+            {
+                if(!(ss>>arg)) return false;
+                test.options += " " + arg;
+            }
+            if(!parse_render_option(option[1], arg.c_str(), test.config)) return false;
+        }
+        return true;
+    }
+}
+
+bool run_batch(const char* manifest_file, int threads, const render_config& config, FILE* out)
+{
+    TRACE_SCOPE("batch");
+
+    FILE* F = fopen(manifest_file, "r");
+    if(!F)
+    {
+        printf("Failed to open file '%s'\n", manifest_file);
+        exit(EXIT_FAILURE);
+    }
+
+    // Tests are named relative to the directory holding the manifest.
+    std::string dir = manifest_file;
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "" : dir.substr(0, slash + 1);
+
+    std::vector<batch_test> tests;
+    char buff[1000];
+    while(fgets(buff, sizeof(buff), F))
+    {
+        std::stringstream ss(buff);
+        std::string item;
+        if(!(ss>>item) || item[0]=='#') continue;
+
+        batch_test test;
+        test.points = atof(item.c_str());
+        test.config = config;
+        if(!(ss>>test.max_error>>test.max_time>>test.name) || !parse_test_options(ss, test))
+        {
+            printf("Unrecognized command: %s", buff);
+            exit(EXIT_FAILURE);
+        }
+        tests.push_back(test);
+    }
+    fclose(F);
+
+    // The shader maps are filled once here so the workers only read them.
+    register_named_shaders();
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    threads = std::max(1, std::min<int>(threads, tests.size()));
+    for(int t = 1; t < threads; t++)
+        workers.push_back(std::thread(run_worker, std::cref(dir), std::ref(tests), std::ref(next)));
+    run_worker(dir, tests, next);
+    for(size_t t = 0; t < workers.size(); t++) workers[t].join();
+
+    double total_score = 0;
+    double total_points = 0;
+    bool all_passed = true;
+    for(size_t i = 0; i < tests.size(); i++)
+    {
+        const batch_test& test = tests[i];
+        total_points += test.points;
+        if(test.size_mismatch)
+        {
+            fprintf(out, "FAIL: (%s%s) Solution dimensions do not match problem size.\n", test.name.c_str(),
+                test.options.c_str());
+            all_passed = false;
+            continue;
+        }
+        bool passed = test.result.mean_error <= test.max_error;
+        fprintf(out, "%s: (%s%s) diff %.2f vs %g, max %d, psnr %.2f, time %.1f ms vs %g\n",
+            passed ? "PASS" : "FAIL", test.name.c_str(), test.options.c_str(), test.result.mean_error, test.max_error,
+            test.result.max_error, test.result.psnr, test.render_ms, test.max_time);
+        if(passed) total_score += test.points;
+        else all_passed = false;
+    }
+    fprintf(out, "FINAL SCORE: %g / %g\n", total_score, total_points);
+    return all_passed;
+}
@@ -0,0 +1,21 @@
+#ifndef __BATCH__
+#define __BATCH__
+
+#include <cstdio>
+#include "driver_state.h"
+
+// Render and check every test listed in manifest_file within this process.
+// The manifest uses the format of grading-scheme.txt:
+//   <num-points> <max-error> <max-time> <test-file> [<options>]
+// where <test-file> names <test-file>.txt (the scene) and <test-file>.png (the
+// reference image) in the directory containing the manifest, and <options>
+// are render options of the command line (RENDER_CONFIG_OPTIONS), such as -M
+// or -D unorm24, for tests of a scene under particular settings.  Tests are
+// spread over threads worker threads, each of which reuses one driver_state
+// (and so its color and depth buffers) for all of the scenes it renders,
+// rendering with the run-wide settings in config plus the options of each
+// test.  One line is printed per test, in manifest order, followed by the
+// total score.  Returns true if every test passed.
+bool run_batch(const char* manifest_file, int threads, const render_config& config, FILE* out);
+
+#endif
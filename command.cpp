@@ -0,0 +1,219 @@
+#include "command.h"
+#include "trace.h"
+#include <algorithm>
+#include <cassert>
+
+namespace
+{
+    // Point the state at vertices stored as floats, or packed if layout says so.
+    void set_vertices(driver_state& state, std::vector<float>& data, const std::vector<unsigned char>& packed,
+        const vertex_layout& layout, int floats_per_vertex)
+    {
+        state.floats_per_vertex = floats_per_vertex;
+        if(layout.packed())
+        {
+            state.vertex_data = 0;
+            state.packed_vertex_data = packed.size() ? &packed[0] : 0;
+            state.packed_layout = layout;
+            state.num_vertices = packed.size() / layout.stride;
+            return;
+        }
+        state.vertex_data = data.size() ? &data[0] : 0;
+        state.packed_vertex_data = 0;
+        state.num_vertices = floats_per_vertex ? data.size() / floats_per_vertex : 0;
+    }
+
+    // Render a draw packet, from the bound buffer object if there is one.
+    void execute_draw(driver_state& state, draw_packet& p, const uniform_patch& patch)
+    {
+        state.vertex_shader = p.vertex_shader;
+        state.fragment_shader = p.fragment_shader;
+
+        // A bound buffer object replaces the accumulated data, and its vertex
+        // layout replaces the draw's.
+        buffer_object* buffer = state.bound_buffer;
+        if(buffer)
+        {
+            std::copy(buffer->interp_rules, buffer->interp_rules + MAX_FLOATS_PER_VERTEX, state.interp_rules);
+            set_vertices(state, buffer->vertex_data, buffer->packed_data, buffer->layout, buffer->floats_per_vertex);
+            state.index_data = buffer->index_data.size() ? &buffer->index_data[0] : 0;
+            state.num_triangles = buffer->index_data.size() / 3;
+        }
+        else
+        {
+            std::copy(p.interp_rules, p.interp_rules + MAX_FLOATS_PER_VERTEX, state.interp_rules);
+            set_vertices(state, p.vertex_data, p.packed_data, p.layout, p.floats_per_vertex);
+            state.index_data = p.index_data.size() ? &p.index_data[0] : 0;
+            state.num_triangles = p.index_data.size() / 3;
+        }
+
+        // Patched uniforms are rendered from copies, so the packet can be
+        // replayed with different patches.
+        std::vector<float> patched_uniform, patched_instances;
+        std::vector<float>* uniform = &p.uniform;
+        std::vector<float>* instance_uniform = &p.instance_uniform;
+        if(patch)
+        {
+            patched_uniform = p.uniform;
+            patch(patched_uniform);
+            uniform = &patched_uniform;
+            if(p.instance_uniform_size)
+            {
+                std::vector<float> block;
+                for(size_t i = 0; i + p.instance_uniform_size <= p.instance_uniform.size(); i += p.instance_uniform_size)
+                {
+                    block.assign(&p.instance_uniform[i], &p.instance_uniform[i] + p.instance_uniform_size);
+                    patch(block);
+                    assert((int)block.size() == p.instance_uniform_size);
+                    patched_instances.insert(patched_instances.end(), block.begin(), block.end());
+                }
+                instance_uniform = &patched_instances;
+            }
+        }
+        state.uniform_data = uniform->size() ? &(*uniform)[0] : 0;
+        state.uniform_size = uniform->size();
+
+        if(p.instances)
+        {
+            state.instance_uniform_data = instance_uniform->size() ? &(*instance_uniform)[0] : 0;
+            state.instance_uniform_size = p.instance_uniform_size;
+            render_instanced(state, p.type, p.instances);
+            state.instance_uniform_data = 0;
+            state.instance_uniform_size = 0;
+        }
+        else if(p.query.empty() || query_visible(state, p.query)) render(state, p.type);
+        else state.stats.draws_skipped++;
+    }
+
+    // Create (or replace) a buffer object from a packet's data.
+    void execute_buffer_create(driver_state& state, const std::string& name, const draw_packet& p)
+    {
+        buffer_object& buffer = state.buffers[name];
+        if(state.bound_buffer == &buffer) state.bound_buffer = 0;
+        buffer = buffer_object();
+        buffer.vertex_data = p.vertex_data;
+        buffer.packed_data = p.packed_data;
+        buffer.layout = p.layout;
+        buffer.index_data = p.index_data;
+        buffer.floats_per_vertex = p.floats_per_vertex;
+        std::copy(p.interp_rules, p.interp_rules + MAX_FLOATS_PER_VERTEX, buffer.interp_rules);
+    }
+}
+
+void execute_command(driver_state& state, command& c, const uniform_patch& patch)
+{
+    switch(c.type)
+    {
+        case command_type::size:
+            initialize_render(state, c.width, c.height);
+            break;
+        case command_type::cull:
+            state.cull_mode = c.cull_mode;
+            state.front_face = c.front_face;
+            break;
+        case command_type::blend:
+            state.blend_enabled = c.enabled;
+            if(!c.enabled) break;
+            state.blend_src = c.blend_src;
+            state.blend_dst = c.blend_dst;
+            state.blend_op = c.blend_op;
+            break;
+        case command_type::texture:
+            set_texture(state, c.unit, c.texture);
+            break;
+        case command_type::sampler:
+            state.texture_units[c.unit].sampler = c.sampler;
+            break;
+        case command_type::target:
+            set_render_target(state, c.unit, c.format);
+            break;
+        case command_type::buffer_create:
+            execute_buffer_create(state, c.name, *c.packet);
+            break;
+        case command_type::buffer_bind:
+            assert(state.buffers.count(c.name) && "unknown buffer");
+            state.bound_buffer = &state.buffers[c.name];
+            break;
+        case command_type::buffer_unbind:
+            state.bound_buffer = 0;
+            break;
+        case command_type::buffer_delete:
+        {
+            std::map<std::string, buffer_object>::iterator it = state.buffers.find(c.name);
+            if(it != state.buffers.end())
+            {
+                if(state.bound_buffer == &it->second) state.bound_buffer = 0;
+                state.buffers.erase(it);
+            }
+            break;
+        }
+        case command_type::query_begin:
+            begin_query(state, c.name, c.enabled);
+            break;
+        case command_type::query_end:
+            end_query(state);
+            break;
+        case command_type::draw:
+            execute_draw(state, *c.packet, patch);
+            break;
+    }
+}
+
+void replay_scene(driver_state& state, std::vector<command>& commands, const uniform_patch& patch)
+{
+    TRACE_SCOPE("replay_scene");
+
+    reset_pipeline_settings(state);
+    for(size_t i = 0; i < commands.size(); i++)
+        execute_command(state, commands[i], patch);
+    resolve_render(state);
+}
+
+command_queue::command_queue(size_t capacity)
+    : capacity(capacity), finished(false)
+{
+}
+
+void command_queue::push(command& c)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    not_full.wait(guard, [this]() { return commands.size() < capacity; });
+    commands.push_back(command());
+    std::swap(commands.back(), c);
+    not_empty.notify_one();
+}
+
+bool command_queue::pop(command& c)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    not_empty.wait(guard, [this]() { return finished || !commands.empty(); });
+    if(commands.empty()) return false;
+    std::swap(c, commands.front());
+    commands.pop_front();
+    not_full.notify_one();
+    return true;
+}
+
+void command_queue::finish()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    finished = true;
+    not_empty.notify_all();
+}
+
+std::shared_ptr<draw_packet> command_queue::new_packet()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if(free_packets.empty()) return std::make_shared<draw_packet>();
+    std::shared_ptr<draw_packet> packet = free_packets.back();
+    free_packets.pop_back();
+    return packet;
+}
+
+void command_queue::recycle(std::shared_ptr<draw_packet>& packet)
+{
+    if(!packet || packet.use_count() != 1) return;
+    std::lock_guard<std::mutex> guard(lock);
+    free_packets.push_back(packet);
+    packet.reset();
+}
@@ -0,0 +1,126 @@
+#ifndef __COMMAND__
+#define __COMMAND__
+
+#include "driver_state.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scene files are parsed into typed commands, which are then executed against
+// a driver_state.  Parsing does all of the text handling and file I/O (texture
+// images are loaded and mipmapped by the parser), so that executing a command
+// only changes state or renders, and the two can run on different threads.
+
+enum class command_type
+{
+    size, cull, blend, texture, sampler, target,
+    buffer_create, buffer_bind, buffer_unbind, buffer_delete,
+    query_begin, query_end, draw
+};
+
+// Everything one draw needs, captured when the parser reaches the render
+// command: the vertices and indices accumulated since the last render, the
+// vertex layout, the uniforms and the shaders.  buffer_create commands carry
+// one too, with the vertices and layout for the new buffer.
+struct draw_packet
+{
+    // Vertices are stored in vertex_data, or encoded in packed_data if layout
+    // is packed.
+    std::vector<float> vertex_data;
+    std::vector<unsigned char> packed_data;
+    vertex_layout layout;
+    std::vector<int> index_data;
+    int floats_per_vertex = 0;
+    interp_type interp_rules[MAX_FLOATS_PER_VERTEX] = {};
+    std::vector<float> uniform;
+    std::vector<float> instance_uniform;
+    int instance_uniform_size = 0;
+    shader_v vertex_shader = 0;
+    shader_f fragment_shader = 0;
+
+    // What to draw.  instances is 0 for a plain render; render_if sets query.
+    render_type type = render_type::invalid;
+    int instances = 0;
+    std::string query;
+};
+
+// One command.  Only the fields used by its type are set:
+//   size            width, height
+//   cull            cull_mode, front_face
+//   blend           enabled, blend_src, blend_dst, blend_op
+//   texture         unit, texture (shared with the texture unit it is bound to)
+//   sampler         unit, sampler
+//   target          unit (the target index), format
+//   buffer_*        name; buffer_create also packet
+//   query_begin     name, enabled (proxy)
+//   draw            packet
+struct command
+{
+    command_type type = command_type::draw;
+    int width = 0, height = 0;
+    int unit = 0;
+    bool enabled = false;
+    std::string name;
+    cull_type cull_mode = cull_type::none;
+    winding_type front_face = winding_type::ccw;
+    blend_factor blend_src = blend_factor::one;
+    blend_factor blend_dst = blend_factor::zero;
+    blend_equation blend_op = blend_equation::add;
+    sampler_state sampler;
+    target_format format = target_format::none;
+    std::shared_ptr<const texture_image> texture;
+    std::shared_ptr<draw_packet> packet;
+};
+
+// Rewrites a copy of a draw's uniforms before it is rendered, such as to
+// replace the camera matrix when a recorded scene is replayed.  Each block of
+// a render_instanced's per-instance uniforms is patched separately.
+typedef std::function<void(std::vector<float>& uniform)> uniform_patch;
+
+// Execute one command.  A draw points the state at its packet's data for the
+// duration of the render; the mesh optimizer and meshlet building may reorder
+// the packet's triangles in place, which leaves the draw itself unchanged.
+// Commands are not used up, so they may be executed again.
+void execute_command(driver_state& state, command& c, const uniform_patch& patch = uniform_patch());
+
+// Parse a scene file once into commands, for rendering it repeatedly with
+// replay_scene without reading or tokenizing the file again.
+void record_scene(const char* test_file, std::vector<command>& commands);
+
+// Render a recorded scene from the default pipeline settings, as parse would
+// have, passing the uniforms of every draw through patch if it is set.
+void replay_scene(driver_state& state, std::vector<command>& commands,
+    const uniform_patch& patch = uniform_patch());
+
+// A bounded first-in first-out queue of commands between a parsing thread and
+// a rendering thread.  push blocks while the queue is full and pop while it is
+// empty; finish marks the end of the stream, after which pop returns false
+// once the queue drains.  Packets of executed draws can be handed back with
+// recycle, and new_packet reuses them (and the memory of their vectors) before
+// allocating more.
+class command_queue
+{
+public:
+    explicit command_queue(size_t capacity);
+
+    void push(command& c);
+    bool pop(command& c);
+    void finish();
+
+    std::shared_ptr<draw_packet> new_packet();
+    void recycle(std::shared_ptr<draw_packet>& packet);
+
+private:
+    size_t capacity;
+    bool finished;
+    std::deque<command> commands;
+    std::vector<std::shared_ptr<draw_packet> > free_packets;
+    std::mutex lock;
+    std::condition_variable not_full, not_empty;
+};
+
+#endif
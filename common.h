@@ -28,6 +28,11 @@ inline void from_pixel(pixel p, int& r, int& g, int& b)
 // driver.floats_per_vertex<=MAX_FLOATS_PER_VERTEX.
 static const int MAX_FLOATS_PER_VERTEX = 64;
 
+// Number of render targets a fragment shader may write.  Target 0 is the image
+// (data_output::output_color); targets 1 and up are optional buffers that a
+// scene enables with the "target" command.
+static const int MAX_RENDER_TARGETS = 4;
+
 class driver_state;
 
 // This is the data that is stored for one vertex.  Although a real GLSL vertex
@@ -43,7 +48,10 @@ struct data_vertex
 {
     float * data;
     // int gl_VertexID;
-    // int gl_InstanceID;
+
+    // Index of the instance being drawn, from 0; always 0 outside of
+    // render_instanced.
+    int gl_InstanceID = 0;
     // int gl_DrawID;
     // int gl_BaseVertex;
     // int gl_BaseInstance;
@@ -63,6 +71,8 @@ struct data_geometry
     float * data;
 };
 
+struct texture_unit;
+
 // This is the data that is the input to the fragment shader.  data should be
 // pointed to a new array whose size is MAX_FLOATS_PER_VERTEX.  This data is
 // interpolated from the per-vertex data.
@@ -80,14 +90,26 @@ struct data_fragment
     // int gl_ViewportIndex;
 
     float * data;
+
+    // Screen-space derivatives of each entry of data, taken across the 2x2
+    // quad of pixels that contains the fragment: the change from the quad's
+    // lower left pixel to its right (ddx) and upper (ddy) neighbors.  They are
+    // only computed while a texture is bound; otherwise they are null.
+    const float * ddx = 0;
+    const float * ddy = 0;
+
+    // The texture units, for sampling with texture() (see texture.h).
+    const texture_unit * textures = 0;
 };
 
 // This structure stores the color of a pixel (fragment) and is populated by the
-// fragment shader.  In real GLSL shaders, this is done a bit differently, and
-// shaders may output more than one color buffer.
+// fragment shader.  In real GLSL shaders, this is done a bit differently.
+// output_color goes to the image; output_targets[i] goes to render target i+1
+// and is ignored unless that target is enabled.
 struct data_output
 {
     vec4 output_color;
+    vec4 output_targets[MAX_RENDER_TARGETS - 1];
     // float gl_FragDepth;
     // int gl_SampleMask[];
 };
@@ -104,4 +126,55 @@ enum class interp_type {invalid, flat, smooth, noperspective};
 // Different layouts for providing triangle data.
 enum class render_type {invalid, indexed, triangle, fan, strip};
 
+// Which triangles the cull stage discards, based on their facing.
+enum class cull_type {none, back, front};
+
+// Winding order (in screen space, with y pointing up) of front-facing triangles.
+enum class winding_type {ccw, cw};
+
+// Rasterization algorithms.
+//   raster_type::standard - floating-point barycentric coordinates evaluated at
+//                           each pixel center; pixels exactly on an edge
+//                           belong to every triangle sharing that edge.
+//   raster_type::fixed    - vertices snapped to 16.8 fixed point, exact 64-bit
+//                           edge functions and the top-left fill rule, so each
+//                           pixel center is covered by exactly one triangle of
+//                           a mesh.
+//   raster_type::homogeneous - edge functions evaluated from the clip-space x, y
+//                           and w of the vertices, without clipping or the
+//                           perspective divide; near and far are tested per
+//                           pixel on the interpolated depth.
+enum class raster_type {standard, fixed, homogeneous};
+
+// Formats for the depth buffer.  Depth is the window-space z/w in [-1,1].
+//   depth_type::float32  - 32-bit float storing z/w directly (the default).
+//   depth_type::unorm16  - 16-bit unsigned normalized; half the memory traffic.
+//   depth_type::unorm24  - 24-bit unsigned normalized, packed into 3 bytes
+//                          per sample; a quarter less memory traffic.
+//   depth_type::reversed - 32-bit float with reversed z: the near plane maps
+//                          to 1 and the far plane to 0, and the test is
+//                          "greater" instead of "less".
+enum class depth_type {float32, unorm16, unorm24, reversed};
+
+// Storage formats for the extra render targets.
+//   target_format::none    - the target is disabled and not written.
+//   target_format::rgba8   - 8-bit unsigned normalized RGBA, saturated to [0,1].
+//   target_format::rgba16f - RGBA as IEEE half floats.
+//   target_format::r32f    - the first channel only, as a 32-bit float.
+enum class target_format {none, rgba8, rgba16f, r32f};
+
+// Blend factors, which scale the fragment (source) color and the color already
+// in the image (destination) before they are combined, as in OpenGL.
+enum class blend_factor {zero, one, src_color, one_minus_src_color, dst_color, one_minus_dst_color,
+    src_alpha, one_minus_src_alpha, dst_alpha, one_minus_dst_alpha};
+
+// Blend equations, combining the scaled source S and destination D.  min and
+// max ignore the factors, as in OpenGL.
+//   blend_equation::add              - S + D
+//   blend_equation::subtract         - S - D
+//   blend_equation::reverse_subtract - D - S
+//   blend_equation::min              - min(source, destination)
+//   blend_equation::max              - max(source, destination)
+enum class blend_equation {add, subtract, reverse_subtract, min, max};
+
 #endif
@@ -0,0 +1,148 @@
+#include "compare.h"
+#include "trace.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <thread>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // Raw sums gathered over a range of pixels; these combine across threads
+    // by addition (and max), and are turned into a compare_result at the end.
+    struct compare_sums
+    {
+        unsigned long long total_error = 0;
+        unsigned long long squared_error = 0;
+        long differing_pixels = 0;
+        int max_error = 0;
+    };
+
+    void compare_pixel(pixel A, pixel B, compare_sums& sums)
+    {
+        int rA,gA,bA,rB,gB,bB;
+        from_pixel(A,rA,gA,bA);
+        from_pixel(B,rB,gB,bB);
+        int r=abs(rA-rB);
+        int g=abs(gA-gB);
+        int b=abs(bA-bB);
+        int diff=std::max(std::max(r,g),b);
+        sums.total_error+=diff;
+        sums.squared_error+=r*r+g*g+b*b;
+        if(diff) sums.differing_pixels++;
+        sums.max_error=std::max(sums.max_error,diff);
+    }
+
+    void compare_range(const pixel* a, const pixel* b, long begin, long end, compare_sums& sums)
+    {
+        TRACE_SCOPE("compare_range", "pixels", end-begin);
+
+        long i=begin;
+#ifdef __SSE2__
+        // Four pixels per iteration.  Pixels are 0xRRGGBBAA, so in each 32-bit
+        // lane byte 0 is alpha (masked off) and bytes 1-3 are B, G and R.
+        const __m128i zero=_mm_setzero_si128();
+        const __m128i rgb_mask=_mm_set1_epi32(0xffffff00);
+        const __m128i max_mask=_mm_set1_epi32(0x0000ff00);
+        __m128i total=zero;     // two 64-bit sums of per-pixel errors
+        __m128i squared=zero;   // two 64-bit sums of squared channel errors
+        __m128i same=zero;      // four 32-bit counts of pixels without error
+        __m128i largest=zero;   // running per-byte maximum
+        long same_count=0;
+        for(;i+4<=end;i+=4)
+        {
+            __m128i p=_mm_loadu_si128((const __m128i*)(a+i));
+            __m128i q=_mm_loadu_si128((const __m128i*)(b+i));
+            __m128i d=_mm_or_si128(_mm_subs_epu8(p,q),_mm_subs_epu8(q,p));
+            d=_mm_and_si128(d,rgb_mask);
+
+            // Bring max(R,G,B) into byte 1 of each lane.
+            __m128i m=_mm_max_epu8(d,_mm_srli_epi32(d,8));
+            m=_mm_max_epu8(m,_mm_srli_epi32(m,16));
+            m=_mm_and_si128(m,max_mask);
+
+            total=_mm_add_epi64(total,_mm_sad_epu8(m,zero));
+            largest=_mm_max_epu8(largest,m);
+            same=_mm_sub_epi32(same,_mm_cmpeq_epi32(m,zero));
+
+            __m128i lo=_mm_unpacklo_epi8(d,zero);
+            __m128i hi=_mm_unpackhi_epi8(d,zero);
+            __m128i sq=_mm_add_epi32(_mm_madd_epi16(lo,lo),_mm_madd_epi16(hi,hi));
+            squared=_mm_add_epi64(squared,_mm_unpacklo_epi32(sq,zero));
+            squared=_mm_add_epi64(squared,_mm_unpackhi_epi32(sq,zero));
+
+            // Drain the 32-bit counters long before they could overflow.
+            if(((i-begin)&((1<<28)-1))==0)
+            {
+                unsigned int c[4];
+                _mm_storeu_si128((__m128i*)c,same);
+                same_count+=(long)c[0]+c[1]+c[2]+c[3];
+                same=zero;
+            }
+        }
+        unsigned long long t[2],s[2];
+        unsigned int c[4];
+        unsigned char l[16];
+        _mm_storeu_si128((__m128i*)t,total);
+        _mm_storeu_si128((__m128i*)s,squared);
+        _mm_storeu_si128((__m128i*)c,same);
+        _mm_storeu_si128((__m128i*)l,largest);
+        same_count+=(long)c[0]+c[1]+c[2]+c[3];
+        sums.total_error+=t[0]+t[1];
+        sums.squared_error+=s[0]+s[1];
+        sums.differing_pixels+=(i-begin)-same_count;
+        for(int k=1;k<16;k+=4) sums.max_error=std::max(sums.max_error,(int)l[k]);
+#endif
+        for(;i<end;i++) compare_pixel(a[i],b[i],sums);
+    }
+}
+
+// Compare two images, splitting the pixels into one contiguous range per thread.
+compare_result compare_images(const pixel* a, const pixel* b, long size, int threads)
+{
+    TRACE_SCOPE("compare_images", "threads", threads);
+
+    threads=(int)std::max<long>(1,std::min<long>(threads,size/4096+1));
+    std::vector<compare_sums> partial(threads);
+    std::vector<std::thread> workers;
+    for(int t=1;t<threads;t++)
+        workers.push_back(std::thread(compare_range,a,b,size*t/threads,size*(t+1)/threads,std::ref(partial[t])));
+    compare_range(a,b,0,size/threads,partial[0]);
+    for(size_t t=0;t<workers.size();t++) workers[t].join();
+
+    compare_sums sums;
+    for(int t=0;t<threads;t++)
+    {
+        sums.total_error+=partial[t].total_error;
+        sums.squared_error+=partial[t].squared_error;
+        sums.differing_pixels+=partial[t].differing_pixels;
+        sums.max_error=std::max(sums.max_error,partial[t].max_error);
+    }
+
+    compare_result result;
+    result.mean_error=sums.total_error/(2.55*size);
+    result.max_error=sums.max_error;
+    result.differing_pixels=sums.differing_pixels;
+    if(sums.squared_error)
+    {
+        double mse=(double)sums.squared_error/(3.0*size);
+        result.psnr=10*log10(255.0*255.0/mse);
+    }
+    else result.psnr=std::numeric_limits<double>::infinity();
+    return result;
+}
+
+// Build the grayscale difference image.
+void make_diff_image(const pixel* a, const pixel* b, long size, pixel* diff)
+{
+    for(long i=0;i<size;i++)
+    {
+        compare_sums sums;
+        compare_pixel(a[i],b[i],sums);
+        diff[i]=make_pixel(sums.max_error,sums.max_error,sums.max_error);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef __COMPARE__
+#define __COMPARE__
+
+#include "common.h"
+
+// Result of comparing a rendered image against a reference.  Per-pixel error
+// is the largest absolute difference over the R, G and B channels (alpha is
+// ignored), which is what the grading scripts have always used.
+struct compare_result
+{
+    // Mean per-pixel error, scaled to a percentage of full intensity.  This is
+    // the number reported as "diff" and checked against test thresholds.
+    double mean_error = 0;
+
+    // Largest per-pixel error, 0-255.
+    int max_error = 0;
+
+    // Number of pixels whose error is nonzero.
+    long differing_pixels = 0;
+
+    // Peak signal-to-noise ratio over the R, G and B channels, in dB.  This is
+    // infinite when the images are identical.
+    double psnr = 0;
+};
+
+// Compare two images of size pixels each.  The work is split across threads
+// threads; the kernel uses SSE2 where available.
+compare_result compare_images(const pixel* a, const pixel* b, long size, int threads);
+
+// Fill diff with a grayscale image of the per-pixel error between a and b, so
+// that differences can be inspected visually.
+void make_diff_image(const pixel* a, const pixel* b, long size, pixel* diff);
+
+#endif
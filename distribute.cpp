@@ -0,0 +1,242 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "distribute.h"
+#include "trace.h"
+
+void parse(const char* test_file, driver_state& state);
+
+namespace
+{
+    // What a worker sends ahead of its pixels: the image size, its band of
+    // rows, the formats of its render targets and what it did.
+    struct worker_header
+    {
+        int width = 0;
+        int height = 0;
+        int min_y = 0;
+        int max_y = -1;
+        target_format targets[MAX_RENDER_TARGETS - 1] = {};
+        double render_ms = 0;
+        render_stats stats;
+    };
+
+    // Write or read all of size bytes, however the pipe splits them up.
+    bool write_all(int fd, const void* data, size_t size)
+    {
+        const char* p = (const char*)data;
+        while(size)
+        {
+            ssize_t n = write(fd, p, size);
+            if(n <= 0) return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool read_all(int fd, void* data, size_t size)
+    {
+        char* p = (char*)data;
+        while(size)
+        {
+            ssize_t n = read(fd, p, size);
+            if(n <= 0) return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // Body of worker process "region": render its band and send it to fd.
+    // Never returns.
+    void run_worker(const char* test_file, driver_state& state, int region, int workers, int fd)
+    {
+        state.config.region = region;
+        state.config.regions = workers;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        parse(test_file, state);
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+        worker_header header;
+        header.width = state.image_width;
+        header.height = state.image_height;
+        header.min_y = state.scissor_min_y;
+        header.max_y = state.scissor_max_y;
+        for(int i = 0; i < MAX_RENDER_TARGETS - 1; i++) header.targets[i] = state.targets[i].format;
+        header.render_ms = std::chrono::duration<double, std::milli>(end - start).count();
+        header.stats = state.stats;
+        bool sent = write_all(fd, &header, sizeof(header));
+        long rows = header.max_y - header.min_y + 1;
+        if(sent && rows > 0)
+            sent = write_all(fd, state.image_color + (long)header.min_y * header.width,
+                sizeof(pixel) * header.width * rows);
+
+        // The band of each enabled target follows, in the same layout.
+        for(int i = 0; sent && rows > 0 && i < MAX_RENDER_TARGETS - 1; i++)
+        {
+            int size = target_format_size(header.targets[i]);
+            if(!size) continue;
+            sent = write_all(fd, state.targets[i].data + (long)header.min_y * header.width * size,
+                (size_t)size * header.width * rows);
+        }
+        close(fd);
+
+        // Leave without running the parent's exit handlers or flushing its
+        // buffered output a second time.
+        _exit(sent ? 0 : EXIT_FAILURE);
+    }
+
+    // Receive the band of a worker into state, which has been initialized for
+    // the image size of the first worker.  Returns false if the band does not
+    // match the image or could not be read.
+    bool read_band(int fd, const worker_header& header, driver_state& state)
+    {
+        if(header.width != state.image_width || header.height != state.image_height) return false;
+        for(int i = 0; i < MAX_RENDER_TARGETS - 1; i++)
+            if(header.targets[i] != state.targets[i].format) return false;
+
+        long rows = header.max_y - header.min_y + 1;
+        if(rows <= 0) return true;
+        if(!read_all(fd, state.image_color + (long)header.min_y * header.width, sizeof(pixel) * header.width * rows))
+            return false;
+        for(int i = 0; i < MAX_RENDER_TARGETS - 1; i++)
+        {
+            int size = target_format_size(header.targets[i]);
+            if(!size) continue;
+            if(!read_all(fd, state.targets[i].data + (long)header.min_y * header.width * size,
+                (size_t)size * header.width * rows))
+                return false;
+        }
+        return true;
+    }
+
+    // Add the counters of a worker to the totals.
+    void add_stats(render_stats& total, const render_stats& s)
+    {
+        total.triangles += s.triangles;
+        total.culled += s.culled;
+        total.clipped += s.clipped;
+        total.clip_triangles += s.clip_triangles;
+        total.degenerate += s.degenerate;
+        total.empty += s.empty;
+        total.tiny += s.tiny;
+        total.vertex_bytes += s.vertex_bytes;
+        total.vertices_shaded += s.vertices_shaded;
+        total.cached_draws += s.cached_draws;
+        total.fragments_shaded += s.fragments_shaded;
+        total.meshlets += s.meshlets;
+        total.meshlets_outside += s.meshlets_outside;
+        total.meshlets_backfacing += s.meshlets_backfacing;
+        total.draws_skipped += s.draws_skipped;
+        total.optimized_triangles += s.optimized_triangles;
+        total.cache_misses_before += s.cache_misses_before;
+        total.cache_misses_after += s.cache_misses_after;
+        total.overdraw_before += s.overdraw_before;
+        total.overdraw_after += s.overdraw_after;
+        total.overdraw_pixels += s.overdraw_pixels;
+    }
+
+    // Whether the scene begins an occlusion query anywhere.  Lines are read
+    // the way parse reads them, so that both agree on what a command is.
+    bool scene_uses_queries(const char* test_file)
+    {
+        FILE* F = fopen(test_file, "r");
+        if(!F) return false;
+        char buff[1000];
+        bool found = false;
+        while(!found && fgets(buff, sizeof(buff), F))
+        {
+            std::stringstream ss(buff);
+            std::string item;
+            found = (ss >> item) && item == "query";
+        }
+        fclose(F);
+        return found;
+    }
+}
+
+void render_distributed(const char* test_file, driver_state& state, int workers, std::vector<double>& worker_ms)
+{
+    TRACE_SCOPE("render_distributed");
+
+    // A worker counts occlusion query samples only within its band, so with
+    // more than one band, workers could disagree about a render_if.
+    if(workers > 1 && scene_uses_queries(test_file))
+    {
+        fprintf(stderr, "Occlusion queries cannot be used with more than one worker process.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Anything buffered now would otherwise be written by every worker too.
+    fflush(stdout);
+    fflush(stderr);
+
+    std::vector<pid_t> pids(workers);
+    std::vector<int> fds(workers);
+    for(int k = 0; k < workers; k++)
+    {
+        int pipe_fds[2];
+        if(pipe(pipe_fds))
+        {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        pids[k] = fork();
+        if(pids[k] < 0)
+        {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if(pids[k] == 0)
+        {
+            close(pipe_fds[0]);
+            for(int i = 0; i < k; i++) close(fds[i]);
+            run_worker(test_file, state, k, workers, pipe_fds[1]);
+        }
+        close(pipe_fds[1]);
+        fds[k] = pipe_fds[0];
+    }
+
+    // Composite the bands as they arrive, in order.
+    worker_ms.assign(workers, 0);
+    render_stats stats;
+    bool failed = false;
+    for(int k = 0; k < workers; k++)
+    {
+        worker_header header;
+        if(!read_all(fds[k], &header, sizeof(header)))
+        {
+            failed = true;
+            close(fds[k]);
+            continue;
+        }
+        if(k == 0)
+        {
+            initialize_render(state, header.width, header.height);
+            for(int i = 0; i < MAX_RENDER_TARGETS - 1; i++)
+                if(header.targets[i] != target_format::none) set_render_target(state, i + 1, header.targets[i]);
+        }
+        if(!read_band(fds[k], header, state)) failed = true;
+        worker_ms[k] = header.render_ms;
+        add_stats(stats, header.stats);
+        close(fds[k]);
+    }
+    for(int k = 0; k < workers; k++)
+    {
+        int status = 0;
+        waitpid(pids[k], &status, 0);
+        if(!WIFEXITED(status) || WEXITSTATUS(status)) failed = true;
+    }
+    if(failed)
+    {
+        fprintf(stderr, "A worker process failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    state.stats = stats;
+}
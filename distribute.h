@@ -0,0 +1,24 @@
+#ifndef __DISTRIBUTE__
+#define __DISTRIBUTE__
+
+#include <vector>
+#include "driver_state.h"
+
+// Sort-first rendering with worker processes.  The image is split into
+// "workers" bands of rows, and one process is forked per band.  Each worker
+// parses test_file itself and renders with the rasterizers restricted to its
+// band (render_config::region), then sends its rows back over a pipe.  The
+// bands are composited into state.image_color, and into each render target
+// enabled at the end of the scene, as if state had rendered the scene.  The
+// counters of the workers are summed into state.stats, so work that every
+// worker repeats, such as vertex shading, is counted once per worker.
+// worker_ms receives the time each worker took to parse and render.
+//
+// Scenes with occlusion queries are rejected when there is more than one
+// worker: a worker only counts the samples that pass within its own band, so
+// render_if would not decide the same way in every band.  The scene is
+// scanned for query commands before any worker starts, and the program exits
+// with an error if it has one.
+void render_distributed(const char* test_file, driver_state& state, int workers, std::vector<double>& worker_ms);
+
+#endif
@@ -1,5 +1,108 @@
 #include "driver_state.h"
+#include "mat.h"
+#include "pack.h"
+#include "trace.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <thread>
+#include <vector>
+
+// Depth buffer formats (see depth_type).  Each one defines the stored type, how
+// a window-space z in [-1,1] is encoded, the value buffers are cleared to, and
+// the depth test.  The cleared value always fails to occlude anything, so every
+// fragment in [-1,1] passes against it; the unorm formats reserve their largest
+// code for this.  The depth buffers are arrays of bytes, size bytes per entry,
+// which load and store read and write.
+template<class T>
+struct depth_storage
+{
+	typedef T value_type;
+	static const int size = sizeof(T);
+	static value_type load(const unsigned char* p)
+	{
+		value_type v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+	static void store(unsigned char* p, value_type v) { memcpy(p, &v, sizeof(v)); }
+};
+
+struct depth_float32 : depth_storage<float>
+{
+	static value_type clear() { return 2; }
+	static value_type encode(float z) { return z; }
+	static bool test(value_type z, value_type stored) { return z < stored; }
+};
+
+struct depth_unorm16 : depth_storage<unsigned short>
+{
+	static value_type clear() { return 0xffff; }
+	static value_type encode(float z)
+	{
+		return std::min(std::max((z + 1) * (0.5f * 0xfffe), 0.f), (float)0xfffe) + 0.5f;
+	}
+	static bool test(value_type z, value_type stored) { return z < stored; }
+};
+
+//Values are computed in an unsigned int but stored in 3 bytes, low byte first
+struct depth_unorm24 : depth_storage<unsigned int>
+{
+	static const int size = 3;
+	static value_type load(const unsigned char* p) { return p[0] | (p[1] << 8) | (p[2] << 16); }
+	static void store(unsigned char* p, value_type v)
+	{
+		p[0] = v;
+		p[1] = v >> 8;
+		p[2] = v >> 16;
+	}
+	static value_type clear() { return 0xffffff; }
+	static value_type encode(float z)
+	{
+		return std::min(std::max((z + 1) * (0.5 * 0xfffffe), 0.), (double)0xfffffe) + 0.5;
+	}
+	static bool test(value_type z, value_type stored) { return z < stored; }
+};
+
+struct depth_reversed : depth_storage<float>
+{
+	static value_type clear() { return -1; }
+	static value_type encode(float z) { return 0.5f - 0.5f * z; }
+	static bool test(value_type z, value_type stored) { return z > stored; }
+};
+
+// Fill a depth buffer of size entries with the clear value of format D.
+template<class D>
+static void clear_depth(unsigned char* depth, int size)
+{
+	for (int i = 0; i < size; i++) D::store(depth + i * D::size, D::clear());
+}
+
+template<class D>
+static void clear_depth(driver_state& state, int size, int samples)
+{
+	clear_depth<D>(state.image_depth, size);
+	if (state.sample_depth) clear_depth<D>(state.sample_depth, size * samples);
+}
+
+// Bytes per entry of a depth buffer in the given format.
+static int depth_format_size(depth_type format)
+{
+	switch (format) {
+	case depth_type::float32: return depth_float32::size;
+	case depth_type::unorm16: return depth_unorm16::size;
+	case depth_type::unorm24: return depth_unorm24::size;
+	case depth_type::reversed: return depth_reversed::size;
+	}
+	return sizeof(float);
+}
+
+template<class D> static void rasterize_triangle_depth(driver_state& state, const data_geometry* in[3]);
+template<class D> static void rasterize_triangle_fixed(driver_state& state, const data_geometry* in[3]);
+template<class D> static void rasterize_triangle_msaa(driver_state& state, const data_geometry* in[3]);
 
 driver_state::driver_state()
 {
@@ -9,441 +112,1068 @@ driver_state::~driver_state()
 {
 	delete[] image_color;
 	delete[] image_depth;
+	delete[] sample_color;
+	delete[] sample_depth;
+	delete[] image_sequence;
+	for (int i = 0; i < MAX_RENDER_TARGETS - 1; i++)
+		delete[] targets[i].data;
 }
 
 // This function should allocate and initialize the arrays that store color and
 // depth.  This is not done during the constructor since the width and height
-// are not known when this class is constructed.
+// are not known when this class is constructed.  If the state already holds
+// buffers of the right size (such as when it is reused for several scenes),
+// they are cleared instead of reallocated.
 void initialize_render(driver_state& state, int width, int height)
 {
+	int samples = state.config.msaa_samples > 1 ? state.config.msaa_samples : 0;
+	depth_type format = state.config.depth_format;
+	int depth_bytes = depth_format_size(format);
+	if (!state.image_color || state.image_width != width || state.image_height != height ||
+		state.image_samples != samples || state.image_depth_format != format ||
+		state.config.sort_triangles != (state.image_sequence != 0)) {
+		delete[] state.image_color;
+		delete[] state.image_depth;
+		delete[] state.sample_color;
+		delete[] state.sample_depth;
+		delete[] state.image_sequence;
+
+		//Initialize the state color and depth arrays to the width*height of the image
+		state.image_color = new pixel[width * height];
+		state.image_depth = new unsigned char[width * height * depth_bytes];
+		state.sample_color = samples ? new pixel[width * height * samples] : 0;
+		state.sample_depth = samples ? new unsigned char[width * height * samples * depth_bytes] : 0;
+		state.image_sequence = state.config.sort_triangles ? new unsigned int[width * height * std::max(samples, 1)] : 0;
+	}
 	state.image_width = width;
 	state.image_height = height;
-	state.image_color = 0;
-	state.image_depth = 0;
-
-	//Initialize the state color and depth arrays to the width*height of the image
-	state.image_color = new pixel[width * height];
-	state.image_depth = new float[width * height];
+	state.image_samples = samples;
+	state.scissor_min_y = height * state.config.region / state.config.regions;
+	state.scissor_max_y = height * (state.config.region + 1) / state.config.regions - 1;
+	state.image_depth_format = format;
 
 	for (int i = 0; i < (width * height); i++) {
 		state.image_color[i] = make_pixel(0, 0, 0);
-		state.image_depth[i] = 2;
 	}
+	for (int i = 0; i < (width * height * samples); i++) {
+		state.sample_color[i] = make_pixel(0, 0, 0);
+	}
+	switch (format) {
+	case depth_type::float32:
+		clear_depth<depth_float32>(state, width * height, samples);
+		break;
+	case depth_type::unorm16:
+		clear_depth<depth_unorm16>(state, width * height, samples);
+		break;
+	case depth_type::unorm24:
+		clear_depth<depth_unorm24>(state, width * height, samples);
+		break;
+	case depth_type::reversed:
+		clear_depth<depth_reversed>(state, width * height, samples);
+		break;
+	}
+	if (state.image_sequence) std::fill_n(state.image_sequence, width * height * std::max(samples, 1), ~0u);
+	state.sequence_base = 0;
 
+	//Resize and clear any render targets that are enabled
+	for (int i = 0; i < MAX_RENDER_TARGETS - 1; i++)
+		if (state.targets[i].format != target_format::none)
+			set_render_target(state, i + 1, state.targets[i].format);
 }
 
-// This function will be called to render the data that has been stored in this class.
-// Valid values of type are:
-//   render_type::triangle - Each group of three vertices corresponds to a triangle.
-//   render_type::indexed -  Each group of three indices in index_data corresponds
-//                           to a triangle.  These numbers are indices into vertex_data.
-//   render_type::fan -      The vertices are to be interpreted as a triangle fan.
-//   render_type::strip -    The vertices are to be interpreted as a triangle strip.
-void render(driver_state& state, render_type type)
+// Bind a texture to a unit.
+void set_texture(driver_state& state, int unit, const std::shared_ptr<const texture_image>& image)
 {
-	bool DEBUG = false;
+	state.texture_units[unit].image = image;
 
-	switch (type) {
+	state.has_textures = false;
+	for (int i = 0; i < MAX_TEXTURE_UNITS; i++)
+		if (state.texture_units[i].image)
+			state.has_textures = true;
+}
 
-	case(render_type::triangle): {
+// Size in bytes of one render target entry.
+int target_format_size(target_format format)
+{
+	switch (format) {
+	case target_format::rgba8: return sizeof(pixel);
+	case target_format::rgba16f: return 4 * sizeof(unsigned short);
+	case target_format::r32f: return sizeof(float);
+	default: return 0;
+	}
+}
 
-		//Initializing a data_vertex array setting the data pointing to the appropriate locations in state.vertex_data
-		data_vertex* vertex_info[state.num_vertices];
-		for (int i = 0, j = 0; i < state.num_vertices* state.floats_per_vertex; i += state.floats_per_vertex, j++) {
-			vertex_info[j] = new data_vertex[MAX_FLOATS_PER_VERTEX];
-			vertex_info[j]->data = &state.vertex_data[i];
-		}
+// Enable, disable or change the format of a render target.
+void set_render_target(driver_state& state, int index, target_format format)
+{
+	render_target& target = state.targets[index - 1];
+	int size = state.image_width * state.image_height * target_format_size(format);
+	delete[] target.data;
+	target.format = format;
+	target.data = size ? new unsigned char[size] : 0;
+	if (size) memset(target.data, 0, size);
+
+	state.has_targets = false;
+	for (int i = 0; i < MAX_RENDER_TARGETS - 1; i++)
+		if (state.targets[i].format != target_format::none)
+			state.has_targets = true;
 
+}
 
-		//Initializing the data_geometry array and sending it to vertex shader to be populated
-		data_geometry* vertex_holders[state.num_vertices];
-		for (int i = 0; i < state.num_vertices; i++) {
-			vertex_holders[i] = new data_geometry();
-			vertex_holders[i]->data = vertex_info[i]->data;
-			state.vertex_shader(*vertex_info[i], *vertex_holders[i], state.uniform_data);
+// Average the samples of each pixel into image_color.
+void resolve_render(driver_state& state)
+{
+	if (!state.image_samples) return;
+
+	TRACE_SCOPE("resolve_render", "samples", state.image_samples);
+
+	int samples = state.image_samples;
+	for (int i = 0; i < state.image_width * state.image_height; i++) {
+		const pixel* p = state.sample_color + i * samples;
+		int r = 0, g = 0, b = 0;
+		for (int s = 0; s < samples; s++) {
+			int sr, sg, sb;
+			from_pixel(p[s], sr, sg, sb);
+			r += sr;
+			g += sg;
+			b += sb;
 		}
+		state.image_color[i] = make_pixel((r + samples / 2) / samples, (g + samples / 2) / samples, (b + samples / 2) / samples);
+	}
+}
 
+// Restore the settings that scene files may change to their defaults.
+void reset_pipeline_settings(driver_state& state)
+{
+	state.cull_mode = cull_type::none;
+	state.front_face = winding_type::ccw;
+	state.buffers.clear();
+	state.bound_buffer = 0;
+	state.blend_enabled = false;
+	state.blend_src = blend_factor::one;
+	state.blend_dst = blend_factor::zero;
+	state.blend_op = blend_equation::add;
+	state.queries.clear();
+	state.active_query.clear();
+	state.query_proxy = false;
+	state.stats = render_stats();
+	for (int i = 0; i < MAX_RENDER_TARGETS - 1; i++)
+		if (state.targets[i].format != target_format::none)
+			set_render_target(state, i + 1, target_format::none);
+	for (int i = 0; i < MAX_TEXTURE_UNITS; i++) {
+		set_texture(state, i, 0);
+		state.texture_units[i].sampler = sampler_state();
+	}
+}
 
-		//Sending each set of 3 vertices to clip_triangle
-		for (int i = 0; i < state.num_vertices / 3; i++) {
-			const data_geometry** triangle = const_cast<const data_geometry**>(vertex_holders + (3 * i));
-			clip_triangle(state, triangle, 0);
-		}
+void begin_query(driver_state& state, const std::string& name, bool proxy)
+{
+	assert(state.active_query.empty() && "queries cannot be nested");
+	state.active_query = name;
+	state.query_start = state.samples_passed;
+	state.query_proxy = proxy;
+}
 
+void end_query(driver_state& state)
+{
+	assert(!state.active_query.empty() && "no query is active");
+	state.queries[state.active_query] = state.samples_passed - state.query_start;
+	state.active_query.clear();
+	state.query_proxy = false;
+}
 
-		//DEALLOCATION
-		for (int i = 0; i < state.num_vertices; i++) {
-			delete[] vertex_info[i];
-			delete vertex_holders[i];
-		}
+bool query_visible(const driver_state& state, const std::string& name)
+{
+	std::map<std::string, long>::const_iterator it = state.queries.find(name);
+	return it == state.queries.end() || it->second > 0;
+}
 
-		break;
+// Write the counters in state.stats to file.
+void print_stats(const driver_state& state, FILE* file)
+{
+	fprintf(file, "triangles: %ld\n", state.stats.triangles);
+	fprintf(file, "culled: %ld\n", state.stats.culled);
+	fprintf(file, "clipped: %ld\n", state.stats.clipped);
+	fprintf(file, "clip triangles: %ld\n", state.stats.clip_triangles);
+	fprintf(file, "degenerate: %ld\n", state.stats.degenerate);
+	fprintf(file, "empty: %ld\n", state.stats.empty);
+	fprintf(file, "tiny: %ld\n", state.stats.tiny);
+	fprintf(file, "vertex bytes: %ld\n", state.stats.vertex_bytes);
+	fprintf(file, "vertices shaded: %ld\n", state.stats.vertices_shaded);
+	fprintf(file, "cached draws: %ld\n", state.stats.cached_draws);
+	fprintf(file, "fragments shaded: %ld\n", state.stats.fragments_shaded);
+	fprintf(file, "meshlets: %ld\n", state.stats.meshlets);
+	fprintf(file, "meshlets outside: %ld\n", state.stats.meshlets_outside);
+	fprintf(file, "meshlets backfacing: %ld\n", state.stats.meshlets_backfacing);
+	fprintf(file, "draws skipped: %ld\n", state.stats.draws_skipped);
+	if (state.stats.optimized_triangles) {
+		const render_stats& s = state.stats;
+		fprintf(file, "acmr: %.3f -> %.3f\n", (double)s.cache_misses_before / s.optimized_triangles,
+			(double)s.cache_misses_after / s.optimized_triangles);
+		fprintf(file, "overdraw: %.3f -> %.3f\n", (double)s.overdraw_before / std::max(s.overdraw_pixels, 1L),
+			(double)s.overdraw_after / std::max(s.overdraw_pixels, 1L));
 	}
-	case(render_type::indexed): {
-		if (DEBUG) std::cout << "triangle_indexed" << std::endl;
+}
 
-		if (DEBUG) {
-			for (int i = 0; i < state.num_vertices * state.floats_per_vertex; i++) {
-				std::cout << "v[" << i << "]:" << state.vertex_data[i] << std::endl;
-			}
-			std::cout << std::endl;
-		}
+bool parse_render_option(char opt, const char* arg, render_config& config)
+{
+	switch (opt) {
+	case 'r':
+		if (!strcmp(arg, "float")) config.raster_mode = raster_type::standard;
+		else if (!strcmp(arg, "fixed")) config.raster_mode = raster_type::fixed;
+		else if (!strcmp(arg, "homogeneous")) config.raster_mode = raster_type::homogeneous;
+		else return false;
+		return true;
+	case 'm':
+		config.msaa_samples = atoi(arg);
+		return config.msaa_samples == 1 || config.msaa_samples == 2 ||
+			config.msaa_samples == 4 || config.msaa_samples == 8;
+	case 'D':
+		if (!strcmp(arg, "float32")) config.depth_format = depth_type::float32;
+		else if (!strcmp(arg, "unorm16")) config.depth_format = depth_type::unorm16;
+		else if (!strcmp(arg, "unorm24")) config.depth_format = depth_type::unorm24;
+		else if (!strcmp(arg, "reversed")) config.depth_format = depth_type::reversed;
+		else return false;
+		return true;
+	case 'O': config.optimize_meshes = true; return true;
+	case 'S': config.sort_triangles = true; return true;
+	case 'M': config.cull_meshlets = true; return true;
+	default: return false;
+	}
+}
 
-		//Initializing a data_vertex array setting the data pointing to the appropriate locations in state.vertex_data
-		data_vertex* vertex_info[state.num_vertices];
-		for (int i = 0, j = 0; i < state.num_vertices* state.floats_per_vertex; i += state.floats_per_vertex, j++) {
-			vertex_info[j] = new data_vertex[MAX_FLOATS_PER_VERTEX];
-			vertex_info[j]->data = &state.vertex_data[i];
-		}
+// Copy count vertices of the render, starting with vertex v, to data as
+// floats, decoding them if they are packed.
+static inline void fetch_vertices(const driver_state& state, int v, int count, float* data)
+{
+	int floats = state.floats_per_vertex;
+	if (state.packed_vertex_data)
+		decode_vertices(state.packed_layout, state.packed_vertex_data + (long)v * state.packed_layout.stride, count, data);
+	else
+		std::copy(state.vertex_data + (long)v * floats, state.vertex_data + (long)(v + count) * floats, data);
+}
 
-		//Initializing the data_geometry array and sending it to vertex shader to be populated
-		data_geometry* vertex_holders[state.num_triangles * 3];
-		for (int i = 0; i < state.num_triangles * 3; i++) {
-			vertex_holders[i] = new data_geometry();
-			vertex_holders[i]->data = vertex_info[state.index_data[i]]->data;
-			state.vertex_shader(*vertex_info[state.index_data[i]], *vertex_holders[i], state.uniform_data);
-		}
+// Size in bytes of the render's vertex data as it is stored.
+static long vertex_data_bytes(const driver_state& state)
+{
+	int stride = state.packed_vertex_data ? state.packed_layout.stride : state.floats_per_vertex * (int)sizeof(float);
+	return (long)state.num_vertices * stride;
+}
 
-		//Sending each triangle to clip_triangle
-		for (int i = 0; i < state.num_triangles; i++) {
-			const data_geometry** triangle = const_cast<const data_geometry**>(vertex_holders + (3 * i));
-			clip_triangle(state, triangle, 0);
+// Run the vertex shader for one instance of a draw.  Indexed draws shade each
+// entry of index_data; the others shade each vertex.  The vertices of those
+// are all fetched at once, before any is shaded.
+static void shade_vertices(const driver_state& state, render_type type, int instance, const float* uniform_data,
+	shaded_vertices& out)
+{
+	int count = type == render_type::indexed ? state.num_triangles * 3 : state.num_vertices;
+	int floats = state.floats_per_vertex;
+	TRACE_SCOPE("vertex_shader", "vertices", count);
+
+	out.geometry.resize(count);
+	out.data.resize(count * floats);
+	out.invocations = 0;
+
+	//Post-transform cache for indexed draws: the last VERTEX_CACHE_SIZE vertices
+	//shaded, replaced first in first out, and the entries they were shaded into
+	int cache_vertex[VERTEX_CACHE_SIZE], cache_entry[VERTEX_CACHE_SIZE], cache_next = 0;
+	std::fill(cache_vertex, cache_vertex + VERTEX_CACHE_SIZE, -1);
+
+	bool indexed = type == render_type::indexed;
+	if (!indexed && count) fetch_vertices(state, 0, count, &out.data[0]);
+	for (int i = 0; i < count; i++) {
+		int v = i;
+		if (indexed) {
+			v = state.index_data[i];
+			int k = std::find(cache_vertex, cache_vertex + VERTEX_CACHE_SIZE, v) - cache_vertex;
+			if (k < VERTEX_CACHE_SIZE) {
+				out.geometry[i] = out.geometry[cache_entry[k]];
+				continue;
+			}
+			cache_vertex[cache_next] = v;
+			cache_entry[cache_next] = i;
+			cache_next = (cache_next + 1) % VERTEX_CACHE_SIZE;
 		}
+		out.invocations++;
+		float* data = &out.data[i * floats];
+		if (indexed) fetch_vertices(state, v, 1, data);
+
+		data_vertex vertex;
+		vertex.data = data;
+		vertex.gl_InstanceID = instance;
+		out.geometry[i].data = data;
+		state.vertex_shader(vertex, out.geometry[i], uniform_data);
+	}
+}
 
-		//DEALLOCATION
-		for (int i = 0; i < state.num_vertices; i++) {
-			delete[] vertex_info[i];
-		}
-		for (int i = 0; i < state.num_triangles * 3; i++) {
-			delete vertex_holders[i];
+// Find the vertices of triangle i of a render of the given type.  Returns false
+// for an unknown type.
+static bool get_triangle(render_type type, const data_geometry* vertices, int i, const data_geometry* triangle[3],
+	bool& flip_winding)
+{
+	flip_winding = false;
+	switch (type) {
+	case render_type::triangle:
+	case render_type::indexed:
+		triangle[0] = &vertices[3 * i];
+		triangle[1] = &vertices[3 * i + 1];
+		triangle[2] = &vertices[3 * i + 2];
+		return true;
+	case render_type::fan:
+		triangle[0] = &vertices[0];
+		triangle[1] = &vertices[i + 1];
+		triangle[2] = &vertices[i + 2];
+		return true;
+	case render_type::strip:
+		triangle[0] = &vertices[i];
+		triangle[1] = &vertices[i + 1];
+		triangle[2] = &vertices[i + 2];
+		//Every odd triangle of a strip lists its vertices against the strip's winding
+		flip_winding = i % 2 == 1;
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Order the triangles of a render nearest first, by the average depth of each
+// one's vertices in front of the eye.  The sort is stable, so triangles at the
+// same depth keep their submission order.
+static void sort_triangles(render_type type, const data_geometry* vertices, int triangles, std::vector<int>& order)
+{
+	TRACE_SCOPE("sort_triangles", "triangles", triangles);
+
+	std::vector<float> depth(triangles);
+	order.resize(triangles);
+	for (int i = 0; i < triangles; i++) {
+		const data_geometry* triangle[3];
+		bool flip_winding;
+		get_triangle(type, vertices, i, triangle, flip_winding);
+		float sum = 0;
+		int visible = 0;
+		for (int k = 0; k < 3; k++) {
+			const vec4& p = triangle[k]->gl_Position;
+			if (p[3] > 0) {
+				sum += p[2] / p[3];
+				visible++;
+			}
 		}
+		depth[i] = visible ? sum / visible : std::numeric_limits<float>::infinity();
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&depth](int a, int b) { return depth[a] < depth[b]; });
+}
 
-		break;
+// Assemble the shaded vertices into triangles according to type, then cull
+// and clip (and so rasterize) each one.  With config.sort_triangles, opaque
+// renders are drawn nearest triangle first.
+static void assemble_triangles(driver_state& state, render_type type, shaded_vertices& shaded)
+{
+	int count = shaded.geometry.size();
+	int triangles = type == render_type::triangle || type == render_type::indexed ? count / 3 : std::max(count - 2, 0);
+	TRACE_SCOPE("clip_triangle", "triangles", triangles);
+	state.stats.triangles += triangles;
+	if (!triangles) return;
+
+	const data_geometry* vertices = &shaded.geometry[0];
+	std::vector<int> order;
+	state.draw_sorted = state.image_sequence && !state.blend_enabled && !(state.image_samples && state.has_targets);
+	if (state.draw_sorted) sort_triangles(type, vertices, triangles, order);
+
+	//The homogeneous rasterizer replaces clipping, except for multisampling
+	bool homogeneous = state.config.raster_mode == raster_type::homogeneous && !state.image_samples;
+
+	//One event for the whole batch; a scope per triangle would swamp the trace
+	TRACE_SCOPE("rasterize_triangle", "triangles", triangles);
+	for (int k = 0; k < triangles; k++) {
+		int i = state.draw_sorted ? order[k] : k;
+		const data_geometry* triangle[3];
+		bool flip_winding;
+		if (!get_triangle(type, vertices, i, triangle, flip_winding)) break;
+		state.triangle_sequence = state.sequence_base + i;
+		if (cull_triangle(state, triangle, flip_winding)) continue;
+		if (homogeneous) rasterize_homogeneous(state, triangle);
+		else clip_triangle(state, triangle);
 	}
-	case(render_type::fan): {
-		if (DEBUG) std::cout << "triangle_fan" << std::endl;
+	state.sequence_base += triangles;
+	state.draw_sorted = false;
+}
 
-		//Initializing a data_vertex array setting the data pointing to the appropriate locations in state.vertex_data
-		data_vertex* vertex_info[state.num_vertices];
-		for (int i = 0, j = 0; i < state.num_vertices* state.floats_per_vertex; i += state.floats_per_vertex, j++) {
-			vertex_info[j] = new data_vertex[MAX_FLOATS_PER_VERTEX];
-			vertex_info[j]->data = &state.vertex_data[i];
-		}
+// Uniform data for an instance: its block of the per-instance uniform array if
+// there is one, and otherwise the draw's uniform data.
+static float* instance_uniform(const driver_state& state, float* uniform_data, int instance)
+{
+	if (!state.instance_uniform_size) return uniform_data;
+	return state.instance_uniform_data + instance * state.instance_uniform_size;
+}
 
-		//Initializing the data_geometry array and sending it to vertex shader to be populated
-		data_geometry* vertex_holders[state.num_vertices];
-		for (int i = 0; i < state.num_vertices; i++) {
-			vertex_holders[i] = new data_geometry();
-			vertex_holders[i]->data = vertex_info[i]->data;
-			state.vertex_shader(*vertex_info[i], *vertex_holders[i], state.uniform_data);
-		}
+// Shade the vertices of a render with its own uniforms.  With
+// config.optimize_meshes, indexed renders are first reordered for the vertex
+// cache (once; clusters records that it has been done), and after shading
+// their clusters are reordered front to back, along with the shaded vertices.
+static void shade_optimized(driver_state& state, render_type type, std::vector<int>& clusters, shaded_vertices& out)
+{
+	int n = state.num_triangles;
+	if (!state.config.optimize_meshes || type != render_type::indexed || !n) {
+		shade_vertices(state, type, 0, state.uniform_data, out);
+		state.stats.vertices_shaded += out.invocations;
+		return;
+	}
 
-		//Creating a triangle according to the triangle_fan scheme and sending each triangle to clip_triangle
-		for (int i = 1, j = 2; i < state.num_vertices - 1; i++, j++) {
-			data_geometry* tri_group[3];
-			tri_group[0] = vertex_holders[0];
-			tri_group[1] = vertex_holders[i];
-			tri_group[2] = vertex_holders[j];
+	std::vector<int> original(state.index_data, state.index_data + 3 * n);
+	if (clusters.empty()) optimize_vertex_cache(state.index_data, n, state.num_vertices, VERTEX_CACHE_SIZE, clusters);
+	shade_vertices(state, type, 0, state.uniform_data, out);
+	state.stats.vertices_shaded += out.invocations;
+
+	std::vector<vec4> positions(state.num_vertices);
+	for (int i = 0; i < 3 * n; i++) positions[state.index_data[i]] = out.geometry[i].gl_Position;
+	std::vector<int> order;
+	optimize_overdraw(state.index_data, n, clusters, &positions[0], order);
+	std::vector<data_geometry> geometry(out.geometry);
+	for (int t = 0; t < n; t++)
+		std::copy(&geometry[3 * order[t]], &geometry[3 * order[t]] + 3, &out.geometry[3 * t]);
+
+	long fragments, pixels;
+	state.stats.optimized_triangles += n;
+	state.stats.cache_misses_before += cache_misses(&original[0], n, VERTEX_CACHE_SIZE);
+	state.stats.cache_misses_after += cache_misses(state.index_data, n, VERTEX_CACHE_SIZE);
+	measure_overdraw(&original[0], n, &positions[0], fragments, pixels);
+	state.stats.overdraw_before += fragments;
+	state.stats.overdraw_pixels += pixels;
+	measure_overdraw(state.index_data, n, &positions[0], fragments, pixels);
+	state.stats.overdraw_after += fragments;
+}
 
-			const data_geometry** triangle = const_cast<const data_geometry**>(tri_group);
-			clip_triangle(state, triangle, 0);
-		}
+// Recover the matrix M with which the vertex shader maps a vertex's position
+// (its first three floats, p) to gl_Position = M*(p,1), by shading the origin
+// and the unit points on each axis.  The other floats of the probes are those
+// of the render's first vertex.  Returns false if the shader does not act like
+// that on a sample of the render's own vertices, so that culling can never
+// remove something the shader would have put on screen.
+static bool probe_transform(const driver_state& state, mat4& M)
+{
+	int floats = state.floats_per_vertex;
+	if (floats < 3 || !state.num_vertices) return false;
+
+	float data[MAX_FLOATS_PER_VERTEX];
+	data_vertex vertex;
+	vertex.data = data;
+	data_geometry probe[4];
+	for (int k = 0; k < 4; k++) {
+		fetch_vertices(state, 0, 1, data);
+		for (int j = 0; j < 3; j++) data[j] = j + 1 == k;
+		probe[k].data = data;
+		state.vertex_shader(vertex, probe[k], state.uniform_data);
+	}
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 3; j++) M(i, j) = probe[j + 1].gl_Position[i] - probe[0].gl_Position[i];
+		M(i, 3) = probe[0].gl_Position[i];
+	}
 
-		//DEALLOCATION
-		for (int i = 0; i < state.num_vertices; i++) {
-			delete[] vertex_info[i];
-			delete vertex_holders[i];
-		}
+	const int samples = 8;
+	for (int k = 0; k < samples; k++) {
+		fetch_vertices(state, (long)state.num_vertices * k / samples, 1, data);
+		vec4 expected = M * vec4(data[0], data[1], data[2], 1);
+		data_geometry shaded;
+		shaded.data = data;
+		state.vertex_shader(vertex, shaded, state.uniform_data);
+		for (int i = 0; i < 4; i++)
+			if (!(std::abs(expected[i] - shaded.gl_Position[i]) <= 1e-4f * (1 + std::abs(shaded.gl_Position[i]))))
+				return false;
+	}
+	return true;
+}
 
-		break;
+// Whether every triangle of meshlet m is discarded by the cull stage, for the
+// transform M.  A triangle's winding in cull_triangle is the determinant of
+// rows x, y and w of M applied to its vertices, which equals C.(n, -n.a) for
+// the triangle's normal n and vertex a, with C made of the 3x3 minors of those
+// rows of M.  C is the camera position in homogeneous object coordinates, so
+// this is the usual test of the normal cone against the direction to the eye.
+static bool meshlet_backfacing(const driver_state& state, const meshlet& m, const mat4& M)
+{
+	if (state.cull_mode == cull_type::none || !m.cone_valid) return false;
+
+	//Triangles with a positive determinant are culled when s is 1, negative ones when it is -1
+	bool cull_positive = (state.cull_mode == cull_type::back) == (state.front_face == winding_type::cw);
+	float s = cull_positive ? 1 : -1;
+	const int rows[3] = {0, 1, 3};
+	vec4 C;
+	for (int i = 0; i < 4; i++) {
+		int cols[3], c = 0;
+		for (int j = 0; j < 4; j++)
+			if (j != i) cols[c++] = j;
+		float minor = M(rows[0], cols[0]) * (M(rows[1], cols[1]) * M(rows[2], cols[2]) - M(rows[1], cols[2]) * M(rows[2], cols[1]))
+			- M(rows[0], cols[1]) * (M(rows[1], cols[0]) * M(rows[2], cols[2]) - M(rows[1], cols[2]) * M(rows[2], cols[0]))
+			+ M(rows[0], cols[2]) * (M(rows[1], cols[0]) * M(rows[2], cols[1]) - M(rows[1], cols[1]) * M(rows[2], cols[0]));
+		C[i] = (i % 2 ? -s : s) * minor;
 	}
-	case(render_type::strip): {
 
-		if (DEBUG) std::cout << "triangle_strip" << std::endl;
+	//A triangle is culled when n.(u - a*t) > 0
+	vec3 u(C[0], C[1], C[2]);
+	float t = C[3];
+	const float margin = 1e-4f;
+	if (std::abs(t) <= 1e-6f * u.magnitude())
+		return dot(m.cone_axis, u.normalized()) > m.cone_sin + margin;
+
+	vec3 eye = u / t;
+	vec3 axis = t > 0 ? -m.cone_axis : m.cone_axis;
+	vec3 to_center = m.center - eye;
+	float distance = to_center.magnitude();
+	return dot(axis, to_center) > m.cone_sin * (distance + m.radius) + m.radius + margin * (distance + m.radius);
+}
 
-		//Initializing a data_vertex array setting the data pointing to the appropriate locations in state.vertex_data
-		data_vertex* vertex_info[state.num_vertices];
-		for (int i = 0, j = 0; i < state.num_vertices* state.floats_per_vertex; i += state.floats_per_vertex, j++) {
-			vertex_info[j] = new data_vertex[MAX_FLOATS_PER_VERTEX];
-			vertex_info[j]->data = &state.vertex_data[i];
+// Whether meshlet m's bounding sphere lies entirely outside one of the planes
+// of the clip volume, for the transform M.
+static bool meshlet_outside(const meshlet& m, const mat4& M)
+{
+	for (int axis = 0; axis < 3; axis++) {
+		for (int sign = -1; sign <= 1; sign += 2) {
+			//The plane w + sign*x_axis >= 0 in object coordinates
+			vec4 plane;
+			for (int j = 0; j < 4; j++) plane[j] = M(3, j) + (float)sign * M(axis, j);
+			vec3 normal(plane[0], plane[1], plane[2]);
+			if (dot(normal, m.center) + plane[3] < -m.radius * normal.magnitude()) return true;
 		}
+	}
+	return false;
+}
 
-		//Initializing the data_geometry array and sending it to vertex shader to be populated
-		data_geometry* vertex_holders[state.num_vertices];
-		for (int i = 0; i < state.num_vertices; i++) {
-			vertex_holders[i] = new data_geometry();
-			vertex_holders[i]->data = vertex_info[i]->data;
-			state.vertex_shader(*vertex_info[i], *vertex_holders[i], state.uniform_data);
+// Shade the vertices of a render.  With config.cull_meshlets, indexed renders
+// are first split into meshlets (once; meshlets records them), and only the
+// triangles of meshlets that may be visible are shaded and drawn.
+static void shade_render(driver_state& state, render_type type, std::vector<int>& clusters,
+	std::vector<meshlet>& meshlets, shaded_vertices& out)
+{
+	bool culling = state.config.cull_meshlets && type == render_type::indexed && state.num_triangles;
+	if (culling && meshlets.empty()) {
+		//Meshlet bounds need the positions as floats
+		std::vector<float> decoded;
+		const float* vertex_data = state.vertex_data;
+		if (state.packed_vertex_data) {
+			decoded.resize((long)state.num_vertices * state.floats_per_vertex);
+			fetch_vertices(state, 0, state.num_vertices, decoded.data());
+			vertex_data = decoded.data();
 		}
+		build_meshlets(state.index_data, state.num_triangles, state.num_vertices, vertex_data,
+			state.floats_per_vertex, meshlets);
+	}
+	mat4 M;
+	if (!culling || !probe_transform(state, M)) {
+		shade_optimized(state, type, clusters, out);
+		return;
+	}
 
-		//Creating a triangle according to the triangle_strip scheme and sending each triangle to clip_triangle
-		for (int i = 0, j = 1, k = 2; i < state.num_vertices - 2; i++, j++, k++) {
-			data_geometry* tri_group[3];
-			tri_group[0] = vertex_holders[i];
-			tri_group[1] = vertex_holders[j];
-			tri_group[2] = vertex_holders[k];
+	TRACE_SCOPE("cull_meshlets", "meshlets", meshlets.size());
+	std::vector<int> visible;
+	for (size_t k = 0; k < meshlets.size(); k++) {
+		const meshlet& m = meshlets[k];
+		if (meshlet_outside(m, M)) state.stats.meshlets_outside++;
+		else if (meshlet_backfacing(state, m, M)) state.stats.meshlets_backfacing++;
+		else visible.insert(visible.end(), state.index_data + 3 * m.first_triangle,
+			state.index_data + 3 * (m.first_triangle + m.num_triangles));
+	}
+	state.stats.meshlets += meshlets.size();
+
+	//The visible triangles change with the view, so they are optimized afresh each time
+	int* index_data = state.index_data;
+	int num_triangles = state.num_triangles;
+	std::vector<int> visible_clusters;
+	state.index_data = visible.empty() ? 0 : &visible[0];
+	state.num_triangles = visible.size() / 3;
+	shade_optimized(state, type, visible_clusters, out);
+	state.index_data = index_data;
+	state.num_triangles = num_triangles;
+}
 
-			const data_geometry** triangle = const_cast<const data_geometry**>(tri_group);
-			clip_triangle(state, triangle, 0);
-		}
+// This function will be called to render the data that has been stored in this class.
+// Valid values of type are:
+//   render_type::triangle - Each group of three vertices corresponds to a triangle.
+//   render_type::indexed -  Each group of three indices in index_data corresponds
+//                           to a triangle.  These numbers are indices into vertex_data.
+//   render_type::fan -      The vertices are to be interpreted as a triangle fan.
+//   render_type::strip -    The vertices are to be interpreted as a triangle strip.
+void render(driver_state& state, render_type type)
+{
+	TRACE_SCOPE("render", "vertices", state.num_vertices);
+	state.stats.vertex_bytes += vertex_data_bytes(state);
+
+	buffer_object* buffer = state.bound_buffer;
+	if (!buffer) {
+		shaded_vertices shaded;
+		std::vector<int> clusters;
+		std::vector<meshlet> meshlets;
+		shade_render(state, type, clusters, meshlets, shaded);
+		assemble_triangles(state, type, shaded);
+		return;
+	}
 
-		//DEALLOCATION
-		for (int i = 0; i < state.num_vertices; i++) {
-			delete[] vertex_info[i];
-			delete vertex_holders[i];
-		}
-		break;
+	//Reuse the buffer's vertex shader results if nothing they depend on has changed
+	bool indexed = type == render_type::indexed;
+	if (buffer->shaded_valid && buffer->shaded_indexed == indexed && buffer->shaded_shader == state.vertex_shader &&
+		buffer->shaded_cull_mode == state.cull_mode && buffer->shaded_front_face == state.front_face &&
+		(int)buffer->shaded_uniform.size() == state.uniform_size &&
+		std::equal(buffer->shaded_uniform.begin(), buffer->shaded_uniform.end(), state.uniform_data)) {
+		state.stats.cached_draws++;
 	}
-	default:;
+	else {
+		shade_render(state, type, buffer->clusters, buffer->meshlets, buffer->shaded);
+		buffer->shaded_valid = true;
+		buffer->shaded_indexed = indexed;
+		buffer->shaded_cull_mode = state.cull_mode;
+		buffer->shaded_front_face = state.front_face;
+		buffer->shaded_shader = state.vertex_shader;
+		buffer->shaded_uniform.assign(state.uniform_data, state.uniform_data + state.uniform_size);
 	}
+	assemble_triangles(state, type, buffer->shaded);
+}
 
+// Render count instances.  Instances are shaded in groups of up to
+// config.threads, one per thread, and each group is then rasterized on this
+// thread in instance order.
+void render_instanced(driver_state& state, render_type type, int count)
+{
+	TRACE_SCOPE("render_instanced", "instances", count);
+	state.stats.vertex_bytes += vertex_data_bytes(state);
+
+	float* uniform_data = state.uniform_data;
+	int threads = std::max(1, std::min(state.config.threads, count));
+	std::vector<shaded_vertices> shaded(threads);
+	for (int first = 0; first < count; first += threads) {
+		int group = std::min(threads, count - first);
+
+		std::vector<std::thread> workers;
+		for (int t = 1; t < group; t++)
+			workers.push_back(std::thread(shade_vertices, std::cref(state), type, first + t,
+				instance_uniform(state, uniform_data, first + t), std::ref(shaded[t])));
+		shade_vertices(state, type, first, instance_uniform(state, uniform_data, first), shaded[0]);
+		for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+		for (int t = 0; t < group; t++) state.stats.vertices_shaded += shaded[t].invocations;
+
+		for (int t = 0; t < group; t++) {
+			state.uniform_data = instance_uniform(state, uniform_data, first + t);
+			assemble_triangles(state, type, shaded[t]);
+		}
+	}
+	state.uniform_data = uniform_data;
 }
 
-// This function clips a triangle (defined by the three vertices in the "in" array).
-// It will be called recursively, once for each clipping face (face=0, 1, ..., 5) to
-// clip against each of the clipping faces in turn.  When face=6, clip_triangle should
-// simply pass the call on to rasterize_triangle.
-void clip_triangle(driver_state& state, const data_geometry* in[3], int face)
+// Decides whether the cull stage discards a triangle.  The winding is taken from
+// the determinant of the x, y and w coordinates of the vertices, which equals
+// w0*w1*w2 times twice the signed screen-space area.  It therefore has the sign
+// of the screen-space winding whenever the triangle is in front of the eye,
+// and still gives the facing of the visible part of triangles that cross w = 0,
+// so culling can happen before the perspective divide and before clipping.
+bool cull_triangle(driver_state& state, const data_geometry* in[3], bool flip_winding)
 {
-	const bool DEBUG = false;
+	if (state.cull_mode == cull_type::none) return false;
+
+	const vec4& a = in[0]->gl_Position;
+	const vec4& b = in[1]->gl_Position;
+	const vec4& c = in[2]->gl_Position;
+	float det = a[0] * (b[1] * c[3] - c[1] * b[3])
+		- b[0] * (a[1] * c[3] - c[1] * a[3])
+		+ c[0] * (a[1] * b[3] - b[1] * a[3]);
+
+	//Degenerate triangles have no facing; leave them to the rasterizer
+	if (det == 0) return false;
+
+	bool ccw = (det > 0) != flip_winding;
+	bool front = ccw == (state.front_face == winding_type::ccw);
+	bool culled = (state.cull_mode == cull_type::back) ? !front : front;
+	if (culled) state.stats.culled++;
+	return culled;
+}
 
-	bool is_positive = true, a_in = false, b_in = false, c_in = false;
-	int plane = 0;
+// Whether a clip-space position is on the inside of clipping face "face":
+// faces 0, 2 and 4 are x = w, y = w and z = w, and faces 1, 3 and 5 are
+// x = -w, y = -w and z = -w.
+static inline bool inside_face(const vec4& p, int face)
+{
+	int axis = face >> 1;
+	return (face & 1) ? p[axis] >= -p[3] : p[axis] <= p[3];
+}
 
-	//Base case: Face == 6, send the triangle rasterize_triangle
-	if (face == 6)
-	{
-		if (DEBUG) std::cout << "RASTERIZING" << std::endl;
-
-		if (DEBUG) {
-			std::cout << "==== " << face << " ====" << std::endl;
-			std::cout << "A " << in[0]->gl_Position << std::endl;
-			for (int i = 3; i < state.floats_per_vertex; i++) std::cout << "   " << in[0]->data[i] << " ";
-			std::cout << std::endl;
-			std::cout << "B " << in[1]->gl_Position << std::endl;
-			for (int i = 3; i < state.floats_per_vertex; i++) std::cout << "   " << in[1]->data[i] << " ";
-			std::cout << std::endl;
-			std::cout << "C " << in[2]->gl_Position << std::endl;
-			for (int i = 3; i < state.floats_per_vertex; i++) std::cout << "   " << in[2]->data[i] << " ";
-			std::cout << std::endl;
-		}
+// Bit f is set when the position is outside of clipping face f.
+static inline int clip_outcode(const vec4& p)
+{
+	int code = 0;
+	for (int face = 0; face < 6; face++)
+		if (!inside_face(p, face)) code |= 1 << face;
+	return code;
+}
 
+// This function clips a triangle (defined by the three vertices in the "in" array)
+// against the six clipping faces and rasterizes what is left.  Triangles inside
+// all of the faces go straight to rasterize_triangle.  Otherwise the triangle is
+// clipped as a polygon against each face that one of its vertices lies outside
+// of (Sutherland-Hodgman), which leaves a convex polygon of at most 9 vertices,
+// and that polygon is rasterized as a fan.
+void clip_triangle(driver_state& state, const data_geometry* in[3])
+{
+	int codes[3];
+	for (int i = 0; i < 3; i++) codes[i] = clip_outcode(in[i]->gl_Position);
+	int any_out = codes[0] | codes[1] | codes[2];
+	if (!any_out) {
 		rasterize_triangle(state, in);
 		return;
 	}
-
-	switch (face)
-	{
-	case 0: //Clipping with x = w
-		is_positive = true;
-		plane = 0;
-		a_in = (in[0]->gl_Position[plane] <= in[0]->gl_Position[3]) ? true : false;
-		b_in = (in[1]->gl_Position[plane] <= in[1]->gl_Position[3]) ? true : false;
-		c_in = (in[2]->gl_Position[plane] <= in[2]->gl_Position[3]) ? true : false;
-		if (DEBUG) std::cout << "Case 0: " << std::endl;
-		break;
-	case 1: //Clipping with x = -w
-		is_positive = false;
-		plane = 0;
-		a_in = (in[0]->gl_Position[plane] >= -in[0]->gl_Position[3]) ? true : false;
-		b_in = (in[1]->gl_Position[plane] >= -in[1]->gl_Position[3]) ? true : false;
-		c_in = (in[2]->gl_Position[plane] >= -in[2]->gl_Position[3]) ? true : false;
-		if (DEBUG) std::cout << "Case 1: " << std::endl;
-		break;
-	case 2: //Clipping with y = w
-		is_positive = true;
-		plane = 1;
-		a_in = (in[0]->gl_Position[plane] <= in[0]->gl_Position[3]) ? true : false;
-		b_in = (in[1]->gl_Position[plane] <= in[1]->gl_Position[3]) ? true : false;
-		c_in = (in[2]->gl_Position[plane] <= in[2]->gl_Position[3]) ? true : false;
-		if (DEBUG) std::cout << "Case 2: " << std::endl;
-		break;
-	case 3: //Clipping with y = -w
-		is_positive = false;
-		plane = 1;
-		a_in = (in[0]->gl_Position[plane] >= -in[0]->gl_Position[3]) ? true : false;
-		b_in = (in[1]->gl_Position[plane] >= -in[1]->gl_Position[3]) ? true : false;
-		c_in = (in[2]->gl_Position[plane] >= -in[2]->gl_Position[3]) ? true : false;
-		if (DEBUG) std::cout << "Case 3: " << std::endl;
-		break;
-	case 4: //Clipping with z = w
-		is_positive = true;
-		plane = 2;
-		a_in = (in[0]->gl_Position[plane] <= in[0]->gl_Position[3]) ? true : false;
-		b_in = (in[1]->gl_Position[plane] <= in[1]->gl_Position[3]) ? true : false;
-		c_in = (in[2]->gl_Position[plane] <= in[2]->gl_Position[3]) ? true : false;
-		if (DEBUG) std::cout << "Case 4: " << std::endl;
-		break;
-	case 5: //Clipping with z = -w
-		is_positive = false;
-		plane = 2;
-		a_in = (in[0]->gl_Position[plane] >= -in[0]->gl_Position[3]) ? true : false;
-		b_in = (in[1]->gl_Position[plane] >= -in[1]->gl_Position[3]) ? true : false;
-		c_in = (in[2]->gl_Position[plane] >= -in[2]->gl_Position[3]) ? true : false;
-		if (DEBUG) std::cout << "Case 5: " << std::endl;
-		break;
-	default:
-		if (DEBUG) std::cout << "default" << std::endl;
-		break;
+	state.stats.clipped++;
+
+	//Wholly outside of one face: nothing is left
+	if (codes[0] & codes[1] & codes[2]) return;
+
+	//Each face adds at most one vertex to the convex polygon and creates at
+	//most two, whose data is stored in new_data.  The polygon is clipped back
+	//and forth between the two vertex arrays.
+	const int MAX_CLIP_VERTICES = 9, MAX_NEW_VERTICES = 12;
+	data_geometry polygon[2][MAX_CLIP_VERTICES];
+	float new_data[MAX_NEW_VERTICES][MAX_FLOATS_PER_VERTEX];
+	int new_count = 0;
+
+	data_geometry* cur = polygon[0];
+	data_geometry* next = polygon[1];
+	int n = 3;
+	for (int i = 0; i < 3; i++) cur[i] = *in[i];
+
+	//Flat data comes from the first vertex of a triangle.  first is the index of
+	//the original first vertex in the polygon or, once that has been clipped
+	//away, of a created vertex, which carries the same flat data.
+	int first = 0;
+	for (int face = 0; face < 6; face++) {
+		if (!(any_out & (1 << face))) continue;
+
+		int m = 0, next_first = -1;
+		for (int i = 0; i < n; i++) {
+			const data_geometry& a = cur[i];
+			const data_geometry& b = cur[i + 1 < n ? i + 1 : 0];
+			bool a_in = inside_face(a.gl_Position, face);
+			bool b_in = inside_face(b.gl_Position, face);
+			if (a_in) {
+				if (m == MAX_CLIP_VERTICES) return;
+				if (i == first) next_first = m;
+				next[m++] = a;
+			}
+			if (a_in != b_in) {
+				//Rounding can leave a sliver that is not quite convex; drop it
+				//rather than overflow
+				if (m == MAX_CLIP_VERTICES || new_count == MAX_NEW_VERTICES) return;
+				if (next_first < 0 && !inside_face(cur[first].gl_Position, face)) next_first = m;
+				set_new_vertex(state, &next[m++], a_in ? &a : &b, a_in ? &b : &a, face >> 1, !(face & 1), in[0],
+					new_data[new_count++]);
+			}
+		}
+		std::swap(cur, next);
+		n = m;
+		first = next_first;
+		if (n < 3) return;
 	}
 
-	//Setting up two data_geometry triangles to hold the possible newly created triangles
-	data_geometry* triangle1[3];
-	data_geometry* triangle2[3];
-	for (int i = 0; i < 3; i++) {
-		triangle1[i] = new data_geometry();
-		triangle2[i] = new data_geometry();
+	//Fan out from the vertex with the first vertex's flat data
+	state.stats.clip_triangles += n - 2;
+	for (int k = 1; k + 1 < n; k++) {
+		const data_geometry* triangle[3] = {&cur[first], &cur[(first + k) % n], &cur[(first + k + 1) % n]};
+		rasterize_triangle(state, triangle);
 	}
-	//Creating two float* to hold the possible new vertex data
-	float* data1 = new float[MAX_FLOATS_PER_VERTEX];
-	float* data2 = new float[MAX_FLOATS_PER_VERTEX];
+}
 
-	if (a_in && b_in && c_in) { //Case 111
-		if (DEBUG) std::cout << "All in" << std::endl;
-		clip_triangle(state, in, face + 1);
+// Value of the blend factor "factor" for channel k, given the source and
+// destination colors in [0,1].
+static inline float blend_weight(blend_factor factor, int k, const float src[4], const float dst[4])
+{
+	switch (factor) {
+	case blend_factor::zero: return 0;
+	case blend_factor::one: return 1;
+	case blend_factor::src_color: return src[k];
+	case blend_factor::one_minus_src_color: return 1 - src[k];
+	case blend_factor::dst_color: return dst[k];
+	case blend_factor::one_minus_dst_color: return 1 - dst[k];
+	case blend_factor::src_alpha: return src[3];
+	case blend_factor::one_minus_src_alpha: return 1 - src[3];
+	case blend_factor::dst_alpha: return dst[3];
+	case blend_factor::one_minus_dst_alpha: return 1 - dst[3];
 	}
-	else if (!a_in && b_in && c_in) {
-		if (DEBUG) std::cout << "BC in" << std::endl;
-
-		//New Triangle 1 (B,C,BA)
-		triangle1[0]->gl_Position = in[1]->gl_Position;	//Set to vertex B position
-		triangle1[0]->data = in[1]->data;				//Set to vertex B data
-
-		triangle1[1]->gl_Position = in[2]->gl_Position; //Set to vertex C position
-		triangle1[1]->data = in[2]->data;				//Set to vertex C data
-
-		set_new_vertex(state, triangle1[2], in[1], in[0], plane, is_positive, data1); //Set to vertex BA
-
-		//New Triangle 2 (C,CA,BA)
-		triangle2[0]->gl_Position = in[2]->gl_Position; //Set to vertex C postion
-		triangle2[0]->data = in[2]->data;				//Set to vertex C data
-
-		set_new_vertex(state, triangle2[1], in[2], in[0], plane, is_positive, data2); //Set to vertex CA
+	return 0;
+}
 
-		triangle2[2]->gl_Position = triangle1[2]->gl_Position;	//Set to vertex BA position
-		triangle2[2]->data = triangle1[2]->data;				//Set to vertex BA data
+// Blend the fragment color "color" into the pixel "dst" according to the blend
+// state.  Colors are combined in units of 1/255, so destination values that
+// are passed through unscaled stay exact, and the result saturates like
+// pack_rgba8.
+static pixel blend_pixel(const driver_state& state, const vec4& color, pixel dst)
+{
+	int d[3];
+	from_pixel(dst, d[0], d[1], d[2]);
+	float src_color[4] = {color[0], color[1], color[2], color[3]};
+	float dst_color[4] = {d[0] / 255.f, d[1] / 255.f, d[2] / 255.f, 1};
+
+	int rgb[3];
+	for (int k = 0; k < 3; k++) {
+		float s = color[k] * 255, t = d[k];
+		float fs = blend_weight(state.blend_src, k, src_color, dst_color);
+		float fd = blend_weight(state.blend_dst, k, src_color, dst_color);
+		float v = 0;
+		switch (state.blend_op) {
+		case blend_equation::add: v = s * fs + t * fd; break;
+		case blend_equation::subtract: v = s * fs - t * fd; break;
+		case blend_equation::reverse_subtract: v = t * fd - s * fs; break;
+		case blend_equation::min: v = std::min(s, t); break;
+		case blend_equation::max: v = std::max(s, t); break;
+		}
+		rgb[k] = v > 0 ? (v < 255 ? (int)v : 255) : 0;
+	}
+	return make_pixel(rgb[0], rgb[1], rgb[2]);
+}
 
-		//Declaring consts for each triangle to pass to clip
-		const data_geometry** t1 = const_cast<const data_geometry**>(triangle1);
-		const data_geometry** t2 = const_cast<const data_geometry**>(triangle2);
-		clip_triangle(state, t1, face + 1);
-		clip_triangle(state, t2, face + 1);
+// Store the extra outputs of a fragment to the enabled render targets at image
+// index "index".
+static void write_targets(driver_state& state, int index, const data_output& out)
+{
+	for (int i = 0; i < MAX_RENDER_TARGETS - 1; i++) {
+		render_target& target = state.targets[i];
+		switch (target.format) {
+		case target_format::rgba8:
+			((pixel*)target.data)[index] = pack_rgba8(out.output_targets[i]);
+			break;
+		case target_format::rgba16f:
+			pack_rgba16f(out.output_targets[i], (unsigned short*)target.data + 4 * index);
+			break;
+		case target_format::r32f:
+			((float*)target.data)[index] = out.output_targets[i][0];
+			break;
+		default:;
+		}
 	}
-	else if (a_in && !b_in && c_in) {
-		if (DEBUG) std::cout << "AC in" << std::endl;
+}
 
-		//New Triangle 1 (C,A,CB)
-		triangle1[0]->gl_Position = in[2]->gl_Position;	//Set to vertex C position
-		triangle1[0]->data = in[2]->data;				//Set to vertex C data
+// The depth test, for a fragment stored at entry "index" of the depth buffer
+// whose current value is "stored".  Passing samples are counted for occlusion
+// queries, and fail anyway in a proxy query so that nothing is written.  With
+// triangle sorting on, a passing fragment's triangle is recorded as the new
+// owner of the entry, and in a sorted render ties go to the triangle submitted
+// first.
+template<class D>
+static inline bool depth_test(driver_state& state, typename D::value_type depth, typename D::value_type stored, int index)
+{
+	if (!D::test(depth, stored) &&
+		!(state.draw_sorted && depth == stored && state.triangle_sequence < state.image_sequence[index]))
+		return false;
+	state.samples_passed++;
+	if (state.query_proxy) return false;
+	if (state.image_sequence) state.image_sequence[index] = state.triangle_sequence;
+	return true;
+}
 
-		triangle1[1]->gl_Position = in[0]->gl_Position; //Set to vertex A position
-		triangle1[1]->data = in[0]->data;				//Set to vertex A position
+// Depth test one fragment of the triangle in the "in" array at pixel (i, j),
+// whose depth z/w is point_z, against a depth buffer in format D, and if it
+// passes, interpolate the vertex data with the screen-space barycentric
+// coordinates alpha, beta and gamma, run the fragment shader and store the
+// result.
+template<class D>
+static void process_fragment_at_depth(driver_state& state, const data_geometry* in[3], int i, int j, float point_z,
+	float alpha, float beta, float gamma)
+{
+	int index = get_image_index(i, j, state.image_width);
 
-		set_new_vertex(state, triangle1[2], in[2], in[1], plane, is_positive, data1); //Set vertex CB
+	//Checking if the current z value is the closest we have seen
+	typename D::value_type depth = D::encode(point_z);
+	unsigned char* depth_entry = state.image_depth + index * D::size;
+	if (!depth_test<D>(state, depth, D::load(depth_entry), index)) return;
 
-		//New Triangle 2 (A,AB,CB)
-		triangle2[0]->gl_Position = in[0]->gl_Position; //Set to vertex A position
-		triangle2[0]->data = in[0]->data;				//Set to vertex A data
+	//Set the current z as the min z so far
+	D::store(depth_entry, depth);
 
-		set_new_vertex(state, triangle2[1], in[0], in[1], plane, is_positive, data2); //Set vertex AB
+	data_output final_color;
+	state.stats.fragments_shaded++;
+	shade_fragment(state, in, i, j, alpha, beta, gamma, final_color);
 
-		triangle2[2]->gl_Position = triangle1[2]->gl_Position;  //Set to vertex CB position
-		triangle2[2]->data = triangle1[2]->data;				//Set to vertex CB data
+	//Set the pixel color to the final color; only blending needs to read the old one
+	if (state.blend_enabled)
+		state.image_color[index] = blend_pixel(state, final_color.output_color, state.image_color[index]);
+	else
+		state.image_color[index] = pack_rgba8(final_color.output_color);
+	if (state.has_targets) write_targets(state, index, final_color);
+}
 
-		//Declaring consts for each triangle to pass to clip
-		const data_geometry** t1 = const_cast<const data_geometry**>(triangle1);
-		const data_geometry** t2 = const_cast<const data_geometry**>(triangle2);
-		clip_triangle(state, t1, face + 1);
-		clip_triangle(state, t2, face + 1);
-	}
-	else if (a_in && b_in && !c_in) {
-		if (DEBUG) std::cout << "AB in" << std::endl;
+// Process the fragment at pixel (i, j) with screen-space barycentric
+// coordinates alpha, beta and gamma, interpolating its depth from them.
+template<class D>
+static void process_fragment(driver_state& state, const data_geometry* in[3], int i, int j, float alpha, float beta, float gamma)
+{
+	//Calculating the z value of the current point
+	float point_z = (alpha * in[0]->gl_Position[2] / in[0]->gl_Position[3]) +(beta * in[1]->gl_Position[2] / in[1]->gl_Position[3]) + 
+		(gamma * in[2]->gl_Position[2] / in[2]->gl_Position[3]);
+	process_fragment_at_depth<D>(state, in, i, j, point_z, alpha, beta, gamma);
+}
 
-		//New Triangle 1 (A,B,AC)
-		triangle1[0]->gl_Position = in[0]->gl_Position; //Set vertex to A position
-		triangle1[0]->data = in[0]->data;				//Set vertex to A data
+// Interpolate the triangle's vertex data at the screen-space barycentric
+// coordinates alpha, beta and gamma into interp_color_data.
+static void interpolate_fragment(const driver_state& state, const data_geometry* in[3], float alpha, float beta,
+	float gamma, float* interp_color_data)
+{
+	//Iterating through each element in the triangle's data
+	for (int k = 0; k < state.floats_per_vertex; k++) {
 
-		triangle1[1]->gl_Position = in[1]->gl_Position; //Set vertex to B position
-		triangle1[1]->data = in[1]->data;				//Set vertex to A data
+		switch (state.interp_rules[k]) {
+		case(interp_type::flat): { //Case flat interpolation
 
-		set_new_vertex(state, triangle1[2], in[0], in[2], plane, is_positive, data1); //Set vertex AC
+			interp_color_data[k] = in[0]->data[k];
+			break;
+		}
+		case(interp_type::smooth): { //Case smooth interpolation 
+			float alpha_p = 0, beta_p = 0, gamma_p = 0, c = 0;
 
-		//New Triangle 2 (B,BC,AC)
-		triangle2[0]->gl_Position = in[1]->gl_Position; //Set to vertex B position
-		triangle2[0]->data = in[1]->data;				//Set to vertex B data
+			c = (alpha / in[0]->gl_Position[3]) + (beta / in[1]->gl_Position[3]) + (gamma / in[2]->gl_Position[3]);
 
-		set_new_vertex(state, triangle2[1], in[1], in[2], plane, is_positive, data2); //Set vertex BC
+			//Calculate the smooth barycentric weights
+			alpha_p = alpha / (in[0]->gl_Position[3] * c);
+			beta_p = beta / (in[1]->gl_Position[3] * c);
+			gamma_p = gamma / (in[2]->gl_Position[3] * c);
 
-		triangle2[2]->gl_Position = triangle1[2]->gl_Position;  //Set to vertex AC position
-		triangle2[2]->data = triangle1[2]->data;				//Set to vertex AC data
+			interp_color_data[k] = (alpha_p * in[0]->data[k] + beta_p * in[1]->data[k] + gamma_p * in[2]->data[k]);
+			break;
+		}
+		case(interp_type::noperspective): { //Case noperspective interpolation
 
-		//Declaring consts for each triangle to pass to clip
-		const data_geometry** t1 = const_cast<const data_geometry**>(triangle1);
-		const data_geometry** t2 = const_cast<const data_geometry**>(triangle2);
-		clip_triangle(state, t1, face + 1);
-		clip_triangle(state, t2, face + 1);
+			//Use the screen-space barycentric weights to interpolate
+			interp_color_data[k] = (alpha * in[0]->data[k] + beta * in[1]->data[k] + gamma * in[2]->data[k]);
+			break;
+		}
+		default:;
+		}
 	}
-	else if (!a_in && !b_in && c_in) {
-		if (DEBUG) std::cout << "C in" << std::endl;
-
-		//New Triangle 1 (C,CA,CB)
-		triangle1[0]->gl_Position = in[2]->gl_Position; //Set to vertex C position
-		triangle1[0]->data = in[2]->data;				//Set to vertex C data
-
-		set_new_vertex(state, triangle1[1], in[2], in[0], plane, is_positive, data1); //Set vertex CA
-		set_new_vertex(state, triangle1[2], in[2], in[1], plane, is_positive, data2); //Set vertex CB
+}
 
-		//Declaring a const the new triangle to pass to clip
-		const data_geometry** t1 = const_cast<const data_geometry**>(triangle1);
-		clip_triangle(state, t1, face + 1);
+// Compute the derivatives of the interpolated data for the fragment at pixel
+// (x, y) the way a GPU does for a 2x2 quad: interpolate at the quad's lower
+// left pixel and at its right and upper neighbors, and take the differences.
+// Those pixels may lie outside of the triangle; the barycentric coordinates
+// are simply extended to them.
+static void quad_derivatives(const driver_state& state, const data_geometry* in[3], int x, int y, float alpha,
+	float beta, float gamma, float* ddx, float* ddy)
+{
+	int width = state.image_width;
+	int height = state.image_height;
+	vec2 pixel_coords[3];
+	for (int i = 0; i < 3; i++) {
+		pixel_coords[i][0] = ((width / 2) * in[i]->gl_Position[0] / in[i]->gl_Position[3]) + ((width / 2) - (0.5));
+		pixel_coords[i][1] = ((height / 2) * in[i]->gl_Position[1] / in[i]->gl_Position[3]) + ((height / 2) - (0.5));
 	}
-	else if (a_in && !b_in && !c_in) {
-		if (DEBUG) std::cout << "A in" << std::endl;
 
-		//New Triangle 1 (A,AB,AC)
-		triangle1[0]->gl_Position = in[0]->gl_Position; //Set to vertex A position
-		triangle1[0]->data = in[0]->data;				//Set to vertex A data
-		set_new_vertex(state, triangle1[1], in[0], in[1], plane, is_positive, data1); //Set vertex AB
-		set_new_vertex(state, triangle1[2], in[0], in[2], plane, is_positive, data2); //Set vertex AC
-
-		//Declaring a const the new triangle to pass to clip
-		const data_geometry** t1 = const_cast<const data_geometry**>(triangle1);
-		clip_triangle(state, t1, face + 1);
+	//The barycentric coordinates are affine in x and y; these are their gradients
+	float ABC_area = get_area(pixel_coords[0], pixel_coords[1], pixel_coords[2]);
+	vec3 grad_x, grad_y;
+	for (int k = 0; k < 3; k++) {
+		const vec2& b = pixel_coords[(k + 1) % 3];
+		const vec2& c = pixel_coords[(k + 2) % 3];
+		grad_x[k] = 0.5f * (b[1] - c[1]) / ABC_area;
+		grad_y[k] = 0.5f * (c[0] - b[0]) / ABC_area;
 	}
-	else if (!a_in && b_in && !c_in) {
-		if (DEBUG) std::cout << "B in" << std::endl;
-
-		//New Triangle 1 (B,BC,BA)
-		triangle1[0]->gl_Position = in[1]->gl_Position; //Set to vertex B position
-		triangle1[0]->data = in[1]->data;				//Set to vertex B position
-		set_new_vertex(state, triangle1[1], in[1], in[2], plane, is_positive, data1); //Set vertex BC
-		set_new_vertex(state, triangle1[2], in[1], in[0], plane, is_positive, data2); //Set vertex BA
 
-		//Declaring a const the new triangle to pass to clip
-		const data_geometry** t1 = const_cast<const data_geometry**>(triangle1);
-		clip_triangle(state, t1, face + 1);
+	vec3 origin = vec3(alpha, beta, gamma) - (float)(x & 1) * grad_x - (float)(y & 1) * grad_y;
+	vec3 right = origin + grad_x, up = origin + grad_y;
+	float at_origin[MAX_FLOATS_PER_VERTEX];
+	interpolate_fragment(state, in, origin[0], origin[1], origin[2], at_origin);
+	interpolate_fragment(state, in, right[0], right[1], right[2], ddx);
+	interpolate_fragment(state, in, up[0], up[1], up[2], ddy);
+	for (int k = 0; k < state.floats_per_vertex; k++) {
+		ddx[k] -= at_origin[k];
+		ddy[k] -= at_origin[k];
 	}
-	else {
-		if (DEBUG) std::cout << "None" << std::endl;
+}
+
+// Interpolate the triangle's vertex data to a fragment and run the fragment shader.
+void shade_fragment(const driver_state& state, const data_geometry* in[3], int x, int y, float alpha, float beta,
+	float gamma, data_output& final_color)
+{
+	data_fragment color_data;
+	float interp_color_data[MAX_FLOATS_PER_VERTEX];
+	interpolate_fragment(state, in, alpha, beta, gamma, interp_color_data);
+	color_data.data = interp_color_data;
+	color_data.textures = state.texture_units;
+
+	float ddx[MAX_FLOATS_PER_VERTEX], ddy[MAX_FLOATS_PER_VERTEX];
+	if (state.has_textures) {
+		quad_derivatives(state, in, x, y, alpha, beta, gamma, ddx, ddy);
+		color_data.ddx = ddx;
+		color_data.ddy = ddy;
 	}
 
+	//Send the interpolated color data to the fragment shader
+	state.fragment_shader(color_data, final_color, state.uniform_data);
+}
 
-	//Deallocation
-	delete[] data1;
-	delete[] data2;
+// Test whether the pixel center (i, j) lies inside the triangle with pixel
+// coordinates "pixel_coords" and signed area ABC_area, and if so process the
+// fragment there.  The sign tests on the sub-areas happen before dividing, so
+// pixels outside of the triangle cost no divisions.
+template<class D>
+static inline void rasterize_pixel(driver_state& state, const data_geometry* in[3], const vec2 pixel_coords[3],
+	float ABC_area, int i, int j)
+{
+	//Defining the current pixel location as a vec2
+	vec2 p(i, j);
 
-	for (int i = 0; i < 3; i++) {
-		delete triangle1[i];
-		delete triangle2[i];
+	//Calculating the area of each sub-triangle
+	float area_a = get_area(p, pixel_coords[1], pixel_coords[2]);
+	float area_b = get_area(p, pixel_coords[2], pixel_coords[0]);
+	float area_c = get_area(p, pixel_coords[0], pixel_coords[1]);
+
+	//Checking if the current location is inside the triangle
+	if (ABC_area > 0) {
+		if (area_a < 0 || area_b < 0 || area_c < 0) return;
 	}
+	else if (area_a > 0 || area_b > 0 || area_c > 0) return;
+
+	//Calculating each barycentric coordinate
+	float alpha = area_a / ABC_area;
+	float beta = area_b / ABC_area;
+	float gamma = area_c / ABC_area;
 
+	process_fragment<D>(state, in, i, j, alpha, beta, gamma);
 }
 
 // Rasterize the triangle defined by the three vertices in the "in" array.  This
 // function is responsible for rasterization, interpolation of data to
 // fragments, calling the fragment shader, and z-buffering.
+//
+// Triangles are classified during setup.  Degenerate ones (zero or invalid
+// area) are dropped, ones whose bounding box contains no pixel center are
+// rejected, and tiny ones (at most 2x2 candidate pixels) skip the general
+// bounding-box loop.
 void rasterize_triangle(driver_state& state, const data_geometry* in[3])
 {
+	//Choose the depth format once per triangle, so the per-fragment test is inlined
+	switch (state.image_depth_format) {
+	case depth_type::float32:
+		rasterize_triangle_depth<depth_float32>(state, in);
+		break;
+	case depth_type::unorm16:
+		rasterize_triangle_depth<depth_unorm16>(state, in);
+		break;
+	case depth_type::unorm24:
+		rasterize_triangle_depth<depth_unorm24>(state, in);
+		break;
+	case depth_type::reversed:
+		rasterize_triangle_depth<depth_reversed>(state, in);
+		break;
+	}
+}
+
+// Rasterize with the rasterizer selected in the config, against a depth buffer
+// in format D.
+template<class D>
+static void rasterize_triangle_depth(driver_state& state, const data_geometry* in[3])
+{
+	if (state.image_samples) {
+		rasterize_triangle_msaa<D>(state, in);
+		return;
+	}
+	if (state.config.raster_mode == raster_type::fixed) {
+		rasterize_triangle_fixed<D>(state, in);
+		return;
+	}
+
 	int width = state.image_width;
 	int height = state.image_height;
 
@@ -454,101 +1184,331 @@ void rasterize_triangle(driver_state& state, const data_geometry* in[3])
 		//Calculates the y pixel coordinate of each vertex
 		pixel_coords[i][1] = ((height / 2) * in[i]->gl_Position[1] / in[i]->gl_Position[3]) + ((height / 2) - (0.5));
 	}
-		
-	//Calculating Bounding Box Coordinates of the triangle
-	int min_x = std::min(std::min(pixel_coords[0][0], pixel_coords[1][0]), pixel_coords[2][0]);
-	int max_x = std::max(std::max(pixel_coords[0][0], pixel_coords[1][0]), pixel_coords[2][0]);
-	int min_y = std::min(std::min(pixel_coords[0][1], pixel_coords[1][1]), pixel_coords[2][1]);
-	int max_y = std::max(std::max(pixel_coords[0][1], pixel_coords[1][1]), pixel_coords[2][1]);
 
-	//Calculating the total area of the triangle
+	//Calculating the total area of the triangle; drop triangles without one
 	float ABC_area = get_area(pixel_coords[0], pixel_coords[1], pixel_coords[2]);
+	if (!(std::abs(ABC_area) > 0)) {
+		state.stats.degenerate++;
+		return;
+	}
 
-	//Looping through the bounding box
-	for (int i = min_x; i <= max_x; i++) {
-		for (int j = min_y; j <= max_y; j++) {
+	//Calculating the range of pixel centers inside the triangle's bounding box
+	int min_x = std::max(0.f, std::ceil(std::min(std::min(pixel_coords[0][0], pixel_coords[1][0]), pixel_coords[2][0])));
+	int max_x = std::min(width - 1.f, std::floor(std::max(std::max(pixel_coords[0][0], pixel_coords[1][0]), pixel_coords[2][0])));
+	int min_y = std::max((float)state.scissor_min_y, std::ceil(std::min(std::min(pixel_coords[0][1], pixel_coords[1][1]), pixel_coords[2][1])));
+	int max_y = std::min((float)state.scissor_max_y, std::floor(std::max(std::max(pixel_coords[0][1], pixel_coords[1][1]), pixel_coords[2][1])));
+	if (min_x > max_x || min_y > max_y) {
+		state.stats.empty++;
+		return;
+	}
 
-			//Declaring the barycentric coordinates
-			float alpha = 0, beta = 0, gamma = 0;
+	//Tiny triangles: test the (at most four) candidate pixels directly
+	if (max_x - min_x <= 1 && max_y - min_y <= 1) {
+		state.stats.tiny++;
+		rasterize_pixel<D>(state, in, pixel_coords, ABC_area, min_x, min_y);
+		if (max_x > min_x) rasterize_pixel<D>(state, in, pixel_coords, ABC_area, max_x, min_y);
+		if (max_y > min_y) {
+			rasterize_pixel<D>(state, in, pixel_coords, ABC_area, min_x, max_y);
+			if (max_x > min_x) rasterize_pixel<D>(state, in, pixel_coords, ABC_area, max_x, max_y);
+		}
+		return;
+	}
 
-			//Defining the current pixel location as a vec2
-			vec2 p(i, j);
-			
-			//Calculating each barycentric coordinate
-			alpha = get_area(p, pixel_coords[1], pixel_coords[2]) / ABC_area;
-			beta = get_area(p, pixel_coords[2], pixel_coords[0]) / ABC_area;
-			gamma = get_area(p, pixel_coords[0], pixel_coords[1]) / ABC_area;
+	//Looping through the bounding box, row by row
+	for (int j = min_y; j <= max_y; j++) {
+		for (int i = min_x; i <= max_x; i++) {
+			rasterize_pixel<D>(state, in, pixel_coords, ABC_area, i, j);
+		}
+	}
+}
+
+// Standard multisample positions for 2, 4 and 8 samples, as offsets from the
+// pixel center in units of 1/16 pixel.
+static const int sample_positions_2[2][2] = {{4, -4}, {-4, 4}};
+static const int sample_positions_4[4][2] = {{-2, 6}, {6, 2}, {-6, -2}, {2, -6}};
+static const int sample_positions_8[8][2] = {{1, 3}, {-1, -3}, {5, -1}, {-3, 5}, {-5, -5}, {-7, 1}, {3, -7}, {7, 7}};
+
+// Rasterize into the multisample buffers.  Coverage and depth are evaluated at
+// every sample, but the fragment shader runs once per pixel: at the pixel
+// center when it is covered, otherwise at the first covered sample so that
+// attributes are never extrapolated outside of the triangle.  The shaded color
+// is stored to each covered sample that passes its depth test.
+template<class D>
+static void rasterize_triangle_msaa(driver_state& state, const data_geometry* in[3])
+{
+	int width = state.image_width;
+	int height = state.image_height;
+	int samples = state.image_samples;
+	const int(*positions)[2] = samples == 2 ? sample_positions_2 : samples == 4 ? sample_positions_4 : sample_positions_8;
 
-			//Checking if the current location is inside the triangle
-			if ((alpha >= 0) && (beta >= 0) && (gamma >= 0)) {
+	vec2 pixel_coords[3];
+	for (int i = 0; i < 3; i++) {
+		pixel_coords[i][0] = ((width / 2) * in[i]->gl_Position[0] / in[i]->gl_Position[3]) + ((width / 2) - (0.5));
+		pixel_coords[i][1] = ((height / 2) * in[i]->gl_Position[1] / in[i]->gl_Position[3]) + ((height / 2) - (0.5));
+	}
 
-				//Calculating the z value of the current point
-				float point_z = (alpha * in[0]->gl_Position[2] / in[0]->gl_Position[3]) +(beta * in[1]->gl_Position[2] / in[1]->gl_Position[3]) + 
-					(gamma * in[2]->gl_Position[2] / in[2]->gl_Position[3]);
+	float ABC_area = get_area(pixel_coords[0], pixel_coords[1], pixel_coords[2]);
+	if (!(std::abs(ABC_area) > 0)) {
+		state.stats.degenerate++;
+		return;
+	}
 
-				//Checking if the current z value is the closest we have seen
-				if (point_z < state.image_depth[get_image_index(i, j, width)]) {
+	//Depth at each vertex, interpolated linearly in screen space
+	float z[3];
+	for (int k = 0; k < 3; k++) z[k] = in[k]->gl_Position[2] / in[k]->gl_Position[3];
+
+	//Samples lie within half a pixel of the center, so widen the pixel range by that much
+	int min_x = std::max(0.f, std::ceil(std::min(std::min(pixel_coords[0][0], pixel_coords[1][0]), pixel_coords[2][0]) - 0.5f));
+	int max_x = std::min(width - 1.f, std::floor(std::max(std::max(pixel_coords[0][0], pixel_coords[1][0]), pixel_coords[2][0]) + 0.5f));
+	int min_y = std::max((float)state.scissor_min_y, std::ceil(std::min(std::min(pixel_coords[0][1], pixel_coords[1][1]), pixel_coords[2][1]) - 0.5f));
+	int max_y = std::min((float)state.scissor_max_y, std::floor(std::max(std::max(pixel_coords[0][1], pixel_coords[1][1]), pixel_coords[2][1]) + 0.5f));
+	if (min_x > max_x || min_y > max_y) {
+		state.stats.empty++;
+		return;
+	}
 
-					//Set the current z as the min z so far
-					state.image_depth[get_image_index(i, j, width)] = point_z;
+	for (int j = min_y; j <= max_y; j++) {
+		for (int i = min_x; i <= max_x; i++) {
+			int index = get_image_index(i, j, width);
+			int passed[8];
+			int num_passed = 0;
+			float shade_weights[3] = {0, 0, 0};
+			bool have_weights = false;
+
+			for (int s = 0; s < samples; s++) {
+				vec2 p(i + positions[s][0] / 16.f, j + positions[s][1] / 16.f);
+				float area_a = get_area(p, pixel_coords[1], pixel_coords[2]);
+				float area_b = get_area(p, pixel_coords[2], pixel_coords[0]);
+				float area_c = get_area(p, pixel_coords[0], pixel_coords[1]);
+				if (ABC_area > 0) {
+					if (area_a < 0 || area_b < 0 || area_c < 0) continue;
+				}
+				else if (area_a > 0 || area_b > 0 || area_c > 0) continue;
+
+				float alpha = area_a / ABC_area, beta = area_b / ABC_area, gamma = area_c / ABC_area;
+				if (!have_weights) {
+					shade_weights[0] = alpha;
+					shade_weights[1] = beta;
+					shade_weights[2] = gamma;
+					have_weights = true;
+				}
 
-					data_output* final_color = new data_output();
-					data_fragment* color_data = new data_fragment();
-					float* interp_color_data = new float[MAX_FLOATS_PER_VERTEX];
+				typename D::value_type sample_z = D::encode(alpha * z[0] + beta * z[1] + gamma * z[2]);
+				unsigned char* depth_entry = state.sample_depth + (index * samples + s) * D::size;
+				if (!depth_test<D>(state, sample_z, D::load(depth_entry), index * samples + s)) continue;
+				D::store(depth_entry, sample_z);
+				passed[num_passed++] = s;
+			}
+			if (!num_passed) continue;
+
+			//Prefer shading at the pixel center when it is inside the triangle
+			vec2 center(i, j);
+			float area_a = get_area(center, pixel_coords[1], pixel_coords[2]);
+			float area_b = get_area(center, pixel_coords[2], pixel_coords[0]);
+			float area_c = get_area(center, pixel_coords[0], pixel_coords[1]);
+			bool center_inside = ABC_area > 0 ? (area_a >= 0 && area_b >= 0 && area_c >= 0)
+				: (area_a <= 0 && area_b <= 0 && area_c <= 0);
+			if (center_inside) {
+				shade_weights[0] = area_a / ABC_area;
+				shade_weights[1] = area_b / ABC_area;
+				shade_weights[2] = area_c / ABC_area;
+			}
 
-					//Iterating through each element in the triangle's data
-					for (int k = 0; k < state.floats_per_vertex; k++) {
+			data_output final_color;
+			state.stats.fragments_shaded++;
+			shade_fragment(state, in, i, j, shade_weights[0], shade_weights[1], shade_weights[2], final_color);
+			pixel* sample_color = state.sample_color + index * samples;
+			if (state.blend_enabled) {
+				for (int k = 0; k < num_passed; k++)
+					sample_color[passed[k]] = blend_pixel(state, final_color.output_color, sample_color[passed[k]]);
+			}
+			else {
+				pixel color = pack_rgba8(final_color.output_color);
+				for (int k = 0; k < num_passed; k++)
+					sample_color[passed[k]] = color;
+			}
+			if (state.has_targets) write_targets(state, index, final_color);
+		}
+	}
+}
 
-						switch (state.interp_rules[k]) {
-						case(interp_type::flat): { //Case flat interpolation
+// Number of fractional bits used for snapped vertex positions (16.8 format).
+static const int SUBPIXEL_BITS = 8;
 
-							interp_color_data[k] = in[0]->data[k];
-							break;
-						}
-						case(interp_type::smooth): { //Case smooth interpolation 
-							float alpha_p = 0, beta_p = 0, gamma_p = 0, c = 0;
+// Rasterize with vertices snapped to the subpixel grid.  Edge functions are
+// evaluated exactly in 64-bit integers, and pixel centers lying exactly on an
+// edge are only included for top and left edges, so pixels on an edge shared
+// by two triangles are drawn exactly once.
+template<class D>
+static void rasterize_triangle_fixed(driver_state& state, const data_geometry* in[3])
+{
+	int width = state.image_width;
+	int height = state.image_height;
+	const long long one = 1 << SUBPIXEL_BITS;
 
-							c = (alpha / in[0]->gl_Position[3]) + (beta / in[1]->gl_Position[3]) + (gamma / in[2]->gl_Position[3]);
+	//Snapping each vertex's pixel coordinates to the subpixel grid
+	long long X[3], Y[3];
+	for (int i = 0; i < 3; i++) {
+		float x = ((width / 2) * in[i]->gl_Position[0] / in[i]->gl_Position[3]) + ((width / 2) - (0.5));
+		float y = ((height / 2) * in[i]->gl_Position[1] / in[i]->gl_Position[3]) + ((height / 2) - (0.5));
+		X[i] = std::llround(x * one);
+		Y[i] = std::llround(y * one);
+	}
 
-							//Calculate the smooth barycentric weights
-							alpha_p = alpha / (in[0]->gl_Position[3] * c);
-							beta_p = beta / (in[1]->gl_Position[3] * c);
-							gamma_p = gamma / (in[2]->gl_Position[3] * c);
+	//Twice the signed area; make the triangle counterclockwise by swapping two vertices
+	long long area = (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+	if (area == 0) {
+		state.stats.degenerate++;
+		return;
+	}
+	int v[3] = {0, 1, 2};
+	if (area < 0) {
+		std::swap(v[1], v[2]);
+		area = -area;
+	}
 
-							interp_color_data[k] = (alpha_p * in[0]->data[k] + beta_p * in[1]->data[k] + gamma_p * in[2]->data[k]);
-							break;
-						}
-						case(interp_type::noperspective): { //Case noperspective interpolation
+	//Calculating the range of pixel centers inside the bounding box
+	long long min_X = std::min(std::min(X[0], X[1]), X[2]), max_X = std::max(std::max(X[0], X[1]), X[2]);
+	long long min_Y = std::min(std::min(Y[0], Y[1]), Y[2]), max_Y = std::max(std::max(Y[0], Y[1]), Y[2]);
+	int min_x = std::max(0LL, (min_X + one - 1) >> SUBPIXEL_BITS);
+	int max_x = std::min(width - 1LL, max_X >> SUBPIXEL_BITS);
+	int min_y = std::max((long long)state.scissor_min_y, (min_Y + one - 1) >> SUBPIXEL_BITS);
+	int max_y = std::min((long long)state.scissor_max_y, max_Y >> SUBPIXEL_BITS);
+	if (min_x > max_x || min_y > max_y) {
+		state.stats.empty++;
+		return;
+	}
 
-							//Use the screen-space barycentric weights to interpolate
-							interp_color_data[k] = (alpha * in[0]->data[k] + beta * in[1]->data[k] + gamma * in[2]->data[k]);
-							break;
-						}
-						default:;
-						}
-					}
+	//Setting up the edge function of the edge opposite each vertex, E(x, y) = A x + B y + C,
+	//which is positive inside the triangle.  Pixels on an edge (E == 0) only count for top
+	//edges (horizontal, with the interior below) and left edges (going down, since the
+	//triangle is counterclockwise with y up); the bias turns that into a test for E >= 0.
+	long long A[3], B[3], E_row[3], bias[3];
+	for (int k = 0; k < 3; k++) {
+		int a = v[(k + 1) % 3], b = v[(k + 2) % 3];
+		long long dx = X[b] - X[a], dy = Y[b] - Y[a];
+		A[k] = -dy * one;
+		B[k] = dx * one;
+		E_row[k] = dx * ((min_y << SUBPIXEL_BITS) - Y[a]) - dy * ((min_x << SUBPIXEL_BITS) - X[a]);
+		bias[k] = (dy < 0 || (dy == 0 && dx < 0)) ? 0 : -1;
+	}
 
-					color_data->data = interp_color_data;
+	for (int j = min_y; j <= max_y; j++) {
+		long long E[3] = {E_row[0], E_row[1], E_row[2]};
+		for (int i = min_x; i <= max_x; i++) {
+			if ((E[0] + bias[0]) >= 0 && (E[1] + bias[1]) >= 0 && (E[2] + bias[2]) >= 0) {
+				//Barycentric weights, returned to the original vertex order
+				float weight[3];
+				for (int k = 0; k < 3; k++) weight[v[k]] = (float)E[k] / area;
+				process_fragment<D>(state, in, i, j, weight[0], weight[1], weight[2]);
+			}
+			for (int k = 0; k < 3; k++) E[k] += A[k];
+		}
+		for (int k = 0; k < 3; k++) E_row[k] += B[k];
+	}
+}
 
-					const data_fragment* c_color_data = const_cast<const data_fragment*>(color_data);
-					//Send the interpolated color data to the fragment shader
-					state.fragment_shader(*c_color_data, *final_color, state.uniform_data);
+// Rasterize in 2D homogeneous coordinates (Olano and Greer, 1997), without
+// clipping or dividing by w.  The (x, y, w) of the vertices are the columns V of
+// a matrix M, and e = M^-1 (X, Y, 1) at the point (X, Y) of normalized device
+// coordinates gives the barycentric coordinates of the point of the triangle
+// that projects there, divided by that point's w.  They are all non-negative
+// exactly where the triangle is visible in front of the eye, even if some of
+// its vertices are behind it.  e[k] * w[k] are the screen-space barycentric
+// coordinates, and the sum of e[k] * z[k] is the depth z/w, which is tested
+// against [-1, 1] in place of clipping to the near and far planes.
+template<class D>
+static void rasterize_triangle_homogeneous(driver_state& state, const data_geometry* in[3])
+{
+	int width = state.image_width;
+	int height = state.image_height;
+	int half_w = width / 2, half_h = height / 2;
+
+	//The rows of M^-1 are the cross products of pairs of columns over det(M)
+	vec3 V[3], edge[3];
+	for (int k = 0; k < 3; k++) V[k] = vec3(in[k]->gl_Position[0], in[k]->gl_Position[1], in[k]->gl_Position[3]);
+	for (int k = 0; k < 3; k++) edge[k] = cross(V[(k + 1) % 3], V[(k + 2) % 3]);
+	float det = dot(V[0], edge[0]);
+	if (!(std::abs(det) > 0)) {
+		state.stats.degenerate++;
+		return;
+	}
 
-					//Set the pixel color to the final color
-					state.image_color[get_image_index(i, j, width)] =
-						make_pixel(final_color->output_color[0] * 255, final_color->output_color[1] * 255, final_color->output_color[2] * 255);
+	//The same functions of the pixel coordinates (i, j): pixel center i is at
+	//X = (i - (half_w - 0.5)) / half_w, and likewise for j
+	float A[3], B[3], C[3];
+	for (int k = 0; k < 3; k++) {
+		vec3 e = edge[k] / det;
+		A[k] = e[0] / half_w;
+		B[k] = e[1] / half_h;
+		C[k] = e[2] - e[0] * (half_w - 0.5f) / half_w - e[1] * (half_h - 0.5f) / half_h;
+	}
 
-					//Deallocation
-					delete[] interp_color_data;
-					delete final_color;
-					delete color_data;
-				}
-			}
+	//Pixels to test: the bounding box of the projected vertices if they are all
+	//in front of the eye.  Otherwise the projection is unbounded, and the edge
+	//functions decide over the whole image.
+	int min_x = 0, max_x = width - 1, min_y = state.scissor_min_y, max_y = state.scissor_max_y;
+	if (V[0][2] > 0 && V[1][2] > 0 && V[2][2] > 0) {
+		vec2 pixel_coords[3];
+		for (int k = 0; k < 3; k++) {
+			pixel_coords[k][0] = (half_w * V[k][0] / V[k][2]) + (half_w - 0.5);
+			pixel_coords[k][1] = (half_h * V[k][1] / V[k][2]) + (half_h - 0.5);
+		}
+		min_x = std::max(0.f, std::ceil(std::min(std::min(pixel_coords[0][0], pixel_coords[1][0]), pixel_coords[2][0])));
+		max_x = std::min(width - 1.f, std::floor(std::max(std::max(pixel_coords[0][0], pixel_coords[1][0]), pixel_coords[2][0])));
+		min_y = std::max((float)state.scissor_min_y, std::ceil(std::min(std::min(pixel_coords[0][1], pixel_coords[1][1]), pixel_coords[2][1])));
+		max_y = std::min((float)state.scissor_max_y, std::floor(std::max(std::max(pixel_coords[0][1], pixel_coords[1][1]), pixel_coords[2][1])));
+		if (min_x > max_x || min_y > max_y) {
+			state.stats.empty++;
+			return;
+		}
+	}
 
+	float z[3];
+	for (int k = 0; k < 3; k++) z[k] = in[k]->gl_Position[2];
+	for (int j = min_y; j <= max_y; j++) {
+		for (int i = min_x; i <= max_x; i++) {
+			float e0 = A[0] * i + B[0] * j + C[0];
+			float e1 = A[1] * i + B[1] * j + C[1];
+			float e2 = A[2] * i + B[2] * j + C[2];
+			if (e0 < 0 || e1 < 0 || e2 < 0) continue;
+			float depth = e0 * z[0] + e1 * z[1] + e2 * z[2];
+			if (!(depth >= -1 && depth <= 1)) continue;
+			process_fragment_at_depth<D>(state, in, i, j, depth, e0 * V[0][2], e1 * V[1][2], e2 * V[2][2]);
 		}
 	}
 }
 
+void rasterize_homogeneous(driver_state& state, const data_geometry* in[3])
+{
+	//Triangles wholly outside of one clipping face cannot be visible
+	int codes[3];
+	for (int i = 0; i < 3; i++) codes[i] = clip_outcode(in[i]->gl_Position);
+	if (codes[0] & codes[1] & codes[2]) return;
+
+	//Interpolation divides by the w of each vertex, so those on the w = 0 plane
+	//are left to the clipper
+	if (in[0]->gl_Position[3] == 0 || in[1]->gl_Position[3] == 0 || in[2]->gl_Position[3] == 0) {
+		clip_triangle(state, in);
+		return;
+	}
+
+	switch (state.image_depth_format) {
+	case depth_type::float32:
+		rasterize_triangle_homogeneous<depth_float32>(state, in);
+		break;
+	case depth_type::unorm16:
+		rasterize_triangle_homogeneous<depth_unorm16>(state, in);
+		break;
+	case depth_type::unorm24:
+		rasterize_triangle_homogeneous<depth_unorm24>(state, in);
+		break;
+	case depth_type::reversed:
+		rasterize_triangle_homogeneous<depth_reversed>(state, in);
+		break;
+	}
+}
+
 //Calculate the area of a triangle with vertices ABC
 float get_area(vec2 a, vec2 b, vec2 c) {
 	return 0.5 * (((b[0] * c[1]) - (c[0] * b[1])) - ((a[0] * c[1]) - (c[0] * a[1])) + ((a[0] * b[1]) - (b[0] * a[1])));
@@ -561,8 +1521,9 @@ int get_image_index(int i, int j, int width) {
 
 //Calculates the intersection point of a plane and a line segment defined by two points v_in and v_out and the interpolated data for that point. 
 //v_in is the point inside the plane and v_out is the point outside of the plane.
-//Interpolates the data for the intersection point in based off of that interp_rule for each data element
-void set_new_vertex(driver_state& state, data_geometry* triangle, const data_geometry* v_in, const data_geometry* v_out, int plane, bool is_pos, float* new_data) {
+//Interpolates the data for the intersection point in based off of that interp_rule for each data element;
+//flat data is taken from the triangle's first vertex, provoking
+void set_new_vertex(driver_state& state, data_geometry* triangle, const data_geometry* v_in, const data_geometry* v_out, int plane, bool is_pos, const data_geometry* provoking, float* new_data) {
 
 	float smooth_alpha = 0, nopersp_alpha = 0;
 
@@ -582,7 +1543,7 @@ void set_new_vertex(driver_state& state, data_geometry* triangle, const data_geo
 	for (int i = 0; i < state.floats_per_vertex; i++) {
 		switch (state.interp_rules[i]) {
 		case(interp_type::flat): {
-			new_data[i] = v_in->data[i];
+			new_data[i] = provoking->data[i];
 			break;
 		}
 		case(interp_type::smooth): {
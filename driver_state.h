@@ -2,6 +2,174 @@
 #define __DRIVER__
 
 #include "common.h"
+#include "meshopt.h"
+#include "texture.h"
+#include "vertex_format.h"
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+// Counters describing the work done by the pipeline.  They are reset at the
+// start of each scene and can be printed with the -c flag.
+struct render_stats
+{
+    // Triangles assembled from the vertex data, before any are discarded.
+    long triangles = 0;
+
+    // Triangles discarded by the cull stage.
+    long culled = 0;
+
+    // Triangles that were not wholly inside the clip volume, and the triangles
+    // the clipper rasterized in their place.
+    long clipped = 0;
+    long clip_triangles = 0;
+
+    // Triangles reaching the rasterizer that were dropped for having no area,
+    // rejected for covering no pixel center, or handled by the tiny-triangle
+    // path (at most 2x2 candidate pixels).
+    long degenerate = 0;
+    long empty = 0;
+    long tiny = 0;
+
+    // Bytes of vertex data, as stored, of the renders issued.
+    long vertex_bytes = 0;
+
+    // Vertex shader invocations, and draws of a buffer object that reused its
+    // cached vertex shader results instead.
+    long vertices_shaded = 0;
+    long cached_draws = 0;
+
+    // Fragment shader invocations.
+    long fragments_shaded = 0;
+
+    // Meshlets considered by meshlet culling (config.cull_meshlets), and those
+    // culled for lying outside of the clip volume or facing away.
+    long meshlets = 0;
+    long meshlets_outside = 0;
+    long meshlets_backfacing = 0;
+
+    // Renders skipped by render_if because their query found nothing visible.
+    long draws_skipped = 0;
+
+    // Work of the mesh optimizer (config.optimize_meshes): the triangles it
+    // reordered, their vertex cache misses before and after, and the
+    // fragments passing the depth test before and after over the pixels
+    // covered, as estimated by measure_overdraw.
+    long optimized_triangles = 0;
+    long cache_misses_before = 0;
+    long cache_misses_after = 0;
+    long overdraw_before = 0;
+    long overdraw_after = 0;
+    long overdraw_pixels = 0;
+};
+
+// Vertex shader results for one draw: a data_geometry for each vertex the draw
+// uses, each pointing at its own copy of the vertex data.  The shader runs in
+// place on that copy, so the draw's vertex data is never modified and
+// instances can be shaded at the same time.  Indexed draws go through a
+// post-transform vertex cache, so index entries that hit it share the copy
+// and the shading of an earlier entry; invocations counts the vertex shader
+// calls actually made.
+struct shaded_vertices
+{
+    std::vector<data_geometry> geometry;
+    std::vector<float> data;
+    int invocations = 0;
+};
+
+// A persistent vertex and index buffer, created with the "buffer" command.  The
+// buffer owns its data and vertex layout, so it can be drawn any number of
+// times without being sent again.  It also keeps the vertex shader results of
+// its last render, which the next render reuses if the vertex shader, the
+// uniform data and the render type (indexed or not) are unchanged, and the
+// cull mode and front face too, since meshlet culling drops back faces before
+// shading.
+struct buffer_object
+{
+    // Vertices are stored in vertex_data, or in packed_data if layout is
+    // packed.
+    std::vector<float> vertex_data;
+    std::vector<unsigned char> packed_data;
+    vertex_layout layout;
+    std::vector<int> index_data;
+    int floats_per_vertex = 0;
+    interp_type interp_rules[MAX_FLOATS_PER_VERTEX] = {};
+
+    // Cached vertex shader results and what they were computed with.
+    shaded_vertices shaded;
+    bool shaded_valid = false;
+    bool shaded_indexed = false;
+    cull_type shaded_cull_mode = cull_type::none;
+    winding_type shaded_front_face = winding_type::ccw;
+    void (*shaded_shader)(const data_vertex&, data_geometry&, const float*) = 0;
+    std::vector<float> shaded_uniform;
+
+    // Clusters of index_data found by the mesh optimizer, which reorders
+    // index_data for the vertex cache only once; empty until then.
+    std::vector<int> clusters;
+
+    // Meshlets of index_data for meshlet culling, which are also found only
+    // once; empty until then.
+    std::vector<meshlet> meshlets;
+};
+
+// An extra render target.  data holds image_width*image_height entries in the
+// same layout as image_color, each 4 (rgba8, r32f) or 8 (rgba16f) bytes.
+struct render_target
+{
+    target_format format = target_format::none;
+    unsigned char * data = 0;
+};
+
+// Settings that apply to a whole run (normally chosen on the command line)
+// rather than being set by commands in a scene file.  Unlike those, they are
+// kept when a driver_state is reused for another scene.
+struct render_config
+{
+    // Algorithm used by rasterize_triangle.
+    raster_type raster_mode = raster_type::standard;
+
+    // Number of samples per pixel for multisample anti-aliasing: 1 (off), 2, 4
+    // or 8.  With more than one sample, coverage and depth are tracked per
+    // sample but the fragment shader still runs once per pixel per triangle.
+    int msaa_samples = 1;
+
+    // Storage format of the depth buffer (and of the multisample depth buffer).
+    depth_type depth_format = depth_type::float32;
+
+    // Number of threads the pipeline may use.  render_instanced shades this
+    // many instances at a time in parallel.
+    int threads = 1;
+
+    // Run the mesh optimizer on indexed renders: reorder index_data for the
+    // vertex cache, then draw clusters of triangles front to back.  The
+    // triangle order of the draw changes, and with it possibly the winner
+    // between fragments of equal depth.
+    bool optimize_meshes = false;
+
+    // Draw the triangles of each render in order of depth, nearest first, so
+    // that fewer fragments are shaded only to be covered later.  Renders that
+    // blend, or that write extra targets with multisampling, keep their order.
+    // Fragments of equal depth resolve as if the triangles had not been
+    // sorted, so images do not change.
+    bool sort_triangles = false;
+
+    // Split indexed renders into meshlets, and skip the vertex shading and
+    // drawing of meshlets that lie outside of the clip volume or, when the
+    // cull stage would discard them, face away from the eye.  This relies on
+    // the vertex shader transforming the first three floats of each vertex
+    // by a matrix; renders whose shader does not are drawn whole.  Triangles
+    // are drawn in meshlet order, so, as with optimize_meshes, the winner
+    // between fragments of equal depth may change.
+    bool cull_meshlets = false;
+
+    // Render only band "region" of the image when it is split into "regions"
+    // bands of rows of equal height, for sort-first rendering by several
+    // processes.  Pixels outside of the band are left cleared.
+    int region = 0;
+    int regions = 1;
+};
 
 struct driver_state
 {
@@ -15,6 +183,12 @@ struct driver_state
     int num_vertices = 0;
     int floats_per_vertex = 0;
 
+    // Vertex data in compact storage formats, used in place of vertex_data
+    // when set.  Each vertex occupies packed_layout.stride bytes and is
+    // decoded to floats_per_vertex floats as it is fetched.
+    const unsigned char * packed_vertex_data = 0;
+    vertex_layout packed_layout;
+
     // If indexed rendering is being performed, this array stores the vertex
     // indices for the triangles, three ints per triangle.
     // i j k i j k i j k i j k ...
@@ -23,12 +197,25 @@ struct driver_state
     int * index_data = 0;
     int num_triangles = 0;
 
+    // Per-instance uniform data for render_instanced: instance i uses the
+    // instance_uniform_size floats starting at
+    // instance_uniform_data+i*instance_uniform_size in place of uniform_data.
+    // With instance_uniform_size zero, every instance uses uniform_data.
+    float * instance_uniform_data = 0;
+    int instance_uniform_size = 0;
+
     // This is data that is constant over all triangles and fragments.
     // It is accessible from all of the shaders.  The user can store things
-    // like transforms here.  The size of this array is not stored
-    // since the driver will never need to know its size; you will just need.
-    // to supply the pointer when necessary.
+    // like transforms here.  uniform_size holds the number of floats in the
+    // array; the driver only uses it to tell whether the uniforms changed
+    // between draws of a buffer object.
     float * uniform_data = 0;
+    int uniform_size = 0;
+
+    // Buffer objects by name, and the one renders currently draw from (null
+    // to draw the data set up in the fields above).
+    std::map<std::string, buffer_object> buffers;
+    buffer_object * bound_buffer = 0;
 
     // Vertex data (such as color) at the vertices of triangles must be
     // interpolated to each pixel (fragment) within the triangle before calling
@@ -44,10 +231,51 @@ struct driver_state
     //                                 barycentric coordinates.
     interp_type interp_rules[MAX_FLOATS_PER_VERTEX] = {};
 
+    // Facing-based culling.  Triangles are classified as front or back facing
+    // by their winding in screen space; front_face gives the winding of front
+    // facing triangles.  Culling happens right after vertex shading, before
+    // clipping, so culled triangles cost neither clipping nor rasterization.
+    cull_type cull_mode = cull_type::none;
+    winding_type front_face = winding_type::ccw;
+
+    // Blending of fragments into the image.  When blend_enabled is false
+    // fragments simply overwrite the image.  Otherwise the fragment color
+    // (including output_color[3], its alpha) is combined with the pixel
+    // already in the image using the factors and equation below.  The image
+    // itself is opaque, so the destination alpha is always 1.  Blending only
+    // applies to the image, not to extra render targets.
+    bool blend_enabled = false;
+    blend_factor blend_src = blend_factor::one;
+    blend_factor blend_dst = blend_factor::zero;
+    blend_equation blend_op = blend_equation::add;
+
+    // Occlusion queries.  samples_passed counts every sample that passes the
+    // depth test (a plain counter, since each driver_state is only ever
+    // rasterized into by one thread).  A query notes it at begin_query, and
+    // end_query stores the difference in queries under the query's name.
+    // While a proxy query is active (query_proxy), passing samples are
+    // counted but nothing is shaded or written.
+    std::map<std::string, long> queries;
+    std::string active_query;
+    long query_start = 0;
+    bool query_proxy = false;
+    long samples_passed = 0;
+
+    // Counters for the work done so far.
+    render_stats stats;
+
+    // Run-wide settings.
+    render_config config;
+
     // Image dimensions
     int image_width = 0;
     int image_height = 0;
 
+    // Rows that the rasterizers may write, from scissor_min_y to scissor_max_y
+    // inclusive: all of them unless config.regions is above one.
+    int scissor_min_y = 0;
+    int scissor_max_y = -1;
+
     // Buffer where color data is stored.  The first image_width entries
     // correspond to the bottom row of the image, the next image_width entries
     // correspond to the next row, etc.  The array has image_width*image_height
@@ -55,8 +283,46 @@ struct driver_state
     pixel * image_color = 0;
 
     // This array stores the depth of a pixel and is used for z-buffering.  The
-    // size and layout is the same as image_color.
-    float * image_depth = 0;
+    // layout is the same as image_color; each entry is stored in the format
+    // image_depth_format, so the array holds image_width*image_height entries
+    // of 2, 3 or 4 bytes.
+    unsigned char * image_depth = 0;
+    depth_type image_depth_format = depth_type::float32;
+
+    // Multisample buffers, allocated when config.msaa_samples is above one.
+    // The samples of each pixel are stored together: sample s of the pixel at
+    // image index i is at i*image_samples+s.  resolve_render averages them
+    // into image_color.
+    int image_samples = 0;
+    pixel * sample_color = 0;
+    unsigned char * sample_depth = 0;
+
+    // Triangle sorting (config.sort_triangles).  Each triangle is numbered in
+    // submission order since the depth buffer was cleared; triangle_sequence
+    // is the number of the one being drawn, and sequence_base that of the
+    // first triangle of the current render.  image_sequence, laid out like
+    // sample_depth with multisampling and like image_depth without, holds the
+    // number of the triangle that last wrote each depth value.  Within a
+    // sorted render (draw_sorted), a fragment whose depth equals the stored
+    // one passes if its triangle was submitted first.
+    unsigned int * image_sequence = 0;
+    unsigned int triangle_sequence = 0;
+    unsigned int sequence_base = 0;
+    bool draw_sorted = false;
+
+    // Render targets 1 and up; targets[i] receives output_targets[i] from the
+    // fragment shader.  has_targets is set if any of them is enabled, so that
+    // fragments skip the extra writes entirely in the common case.  With
+    // multisampling these are not multisampled: a pixel is written whenever
+    // any of its samples passes the depth test.
+    render_target targets[MAX_RENDER_TARGETS - 1];
+    bool has_targets = false;
+
+    // Textures bound with the "texture" command, and how each unit samples.
+    // has_textures is set if any unit has a texture; only then does shading
+    // compute the derivatives that texture sampling needs.
+    texture_unit texture_units[MAX_TEXTURE_UNITS];
+    bool has_textures = false;
 
     // Pointer to a function, which performs the role of a vertex shader.  It
     // should be called on each vertex and given data stored in vertex_data.
@@ -80,6 +346,51 @@ struct driver_state
 // constructed.
 void initialize_render(driver_state& state, int width, int height);
 
+// Enable render target "index" (1 to MAX_RENDER_TARGETS-1) with the given
+// format, or disable it with target_format::none.  The target is allocated for
+// the current image size and cleared to zero.
+void set_render_target(driver_state& state, int index, target_format format);
+
+// Bind image to texture unit "unit", replacing any texture already bound
+// there.  image may be null to unbind the unit.
+void set_texture(driver_state& state, int unit, const std::shared_ptr<const texture_image>& image);
+
+// Size in bytes of one entry of a render target in the given format.
+int target_format_size(target_format format);
+
+// Start counting the samples that pass the depth test for the query called
+// name.  With proxy set, the renders until end_query only count; they leave
+// the image and depth buffer unchanged.  Queries cannot be nested.
+void begin_query(driver_state& state, const std::string& name, bool proxy);
+
+// Finish the active query, storing its result.
+void end_query(driver_state& state);
+
+// Whether renders conditional on the query called name should be drawn: true
+// unless the query has finished with no samples passing.
+bool query_visible(const driver_state& state, const std::string& name);
+
+// Average the samples of each pixel into image_color.  This does nothing unless
+// multisampling is enabled; parse calls it once all renders are done.
+void resolve_render(driver_state& state);
+
+// Restore the settings that commands in a scene file may change (such as the
+// cull mode) to their defaults and clear the counters.  This is done at the
+// start of every scene, so that a driver_state can be reused for several.
+void reset_pipeline_settings(driver_state& state);
+
+// Write the counters in state.stats to file, one "name: value" line each.
+void print_stats(const driver_state& state, FILE* file);
+
+// The command line options that set fields of render_config, in the syntax of
+// getopt: -r <raster-mode>, -m <samples>, -D <depth-format>, -O, -S and -M.
+#define RENDER_CONFIG_OPTIONS "r:m:D:OSM"
+
+// Set the field of config chosen by option opt, one of RENDER_CONFIG_OPTIONS,
+// from its argument arg (unused by options that take none).  Returns false if
+// opt is not one of them or arg is not a valid value.
+bool parse_render_option(char opt, const char* arg, render_config& config);
+
 // This function will be called to render the data that has been stored in this class.
 // Valid values of type are:
 //   render_type::triangle - Each group of three vertices corresponds to a triangle.
@@ -89,19 +400,42 @@ void initialize_render(driver_state& state, int width, int height);
 //   render_type::strip -    The vertices are to be interpreted as a triangle strip.
 void render(driver_state& state, render_type type);
 
-// This function clips a triangle (defined by the three vertices in the "in" array).
-// It will be called recursively, once for each clipping face (face=0, 1, ..., 5) to
-// clip against each of the clipping faces in turn.  When face=6, clip_triangle should
-// simply pass the call on to rasterize_triangle.
-void clip_triangle(driver_state& state, const data_geometry* in[3],int face=0);
+// Render the data that has been stored in this class count times, as render
+// does.  The vertex shader sees the instance number as gl_InstanceID, and each
+// instance gets its own uniform data if instance_uniform_size is set.
+// Instances are vertex shaded on up to config.threads threads, but always
+// rasterized in order.
+void render_instanced(driver_state& state, render_type type, int count);
+
+// This function clips a triangle (defined by the three vertices in the "in" array)
+// against all six clipping faces in one pass and passes what is left on to
+// rasterize_triangle, as a fan of triangles if the triangle had to be cut.
+void clip_triangle(driver_state& state, const data_geometry* in[3]);
 
 // Rasterize the triangle defined by the three vertices in the "in" array.  This
 // function is responsible for rasterization, interpolation of data to
 // fragments, calling the fragment shader, and z-buffering.
 void rasterize_triangle(driver_state& state, const data_geometry* in[3]);
 
+// Rasterize the triangle defined by the three vertices in the "in" array with
+// 2D homogeneous edge functions, which takes the place of both clip_triangle
+// and rasterize_triangle for raster_type::homogeneous.
+void rasterize_homogeneous(driver_state& state, const data_geometry* in[3]);
+
+// Returns true if the cull stage should discard the triangle defined by the
+// three vertices in the "in" array.  flip_winding is set for triangles whose
+// vertices are listed in the opposite order from how they are wound, such as
+// every other triangle of a strip.
+bool cull_triangle(driver_state& state, const data_geometry* in[3], bool flip_winding);
+
+// Interpolate the vertex data of the triangle "in" with the screen-space
+// barycentric coordinates alpha, beta and gamma and run the fragment shader for
+// the fragment at pixel (x, y).
+void shade_fragment(const driver_state& state, const data_geometry* in[3], int x, int y, float alpha, float beta,
+    float gamma, data_output& out);
+
 //Helper Functions
 float get_area(vec2 a, vec2 b, vec2 c);
 int get_image_index(int x, int y, int width);
-void set_new_vertex(driver_state& state, data_geometry* triangle, const data_geometry* v_in, const data_geometry* v_out, int plane, bool is_pos, float* new_data);
+void set_new_vertex(driver_state& state, data_geometry* triangle, const data_geometry* v_in, const data_geometry* v_out, int plane, bool is_pos, const data_geometry* provoking, float* new_data);
 #endif
@@ -1,11 +1,114 @@
 #include <png.h>
+#include <zlib.h>
 #include <cassert>
+#include <cstdio>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dump_png.h"
+#include "trace.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 
 typedef unsigned int Pixel;
 
-// Dump an image to file.
-void dump_png(Pixel* data,int width,int height,const char* filename)
+// Pixels are packed as 0xRRGGBBAA in a native int, so on little-endian hosts
+// their bytes sit in memory as A B G R.  PNG and PAM want R G B A, which is a
+// byte reversal of every 32-bit word; PPM additionally drops the alpha byte.
+static bool host_is_little_endian()
+{
+    const Pixel probe=1;
+    return *(const unsigned char*)&probe==1;
+}
+
+// Convert n pixels to R G B A bytes.
+static void pixels_to_rgba(const Pixel* src,unsigned char* dst,int n)
+{
+    int i=0;
+    if(!host_is_little_endian())
+    {
+        memcpy(dst,src,n*sizeof(Pixel));
+        return;
+    }
+#if defined(__SSSE3__)
+    const __m128i reverse=_mm_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+    for(;i+4<=n;i+=4)
+    {
+        __m128i p=_mm_loadu_si128((const __m128i*)(src+i));
+        _mm_storeu_si128((__m128i*)(dst+4*i),_mm_shuffle_epi8(p,reverse));
+    }
+#elif defined(__SSE2__)
+    for(;i+4<=n;i+=4)
+    {
+        // Swap the bytes within each 16-bit half, then swap the halves.
+        __m128i p=_mm_loadu_si128((const __m128i*)(src+i));
+        p=_mm_or_si128(_mm_slli_epi16(p,8),_mm_srli_epi16(p,8));
+        p=_mm_shufflelo_epi16(p,_MM_SHUFFLE(2,3,0,1));
+        p=_mm_shufflehi_epi16(p,_MM_SHUFFLE(2,3,0,1));
+        _mm_storeu_si128((__m128i*)(dst+4*i),p);
+    }
+#endif
+    for(;i<n;i++)
+    {
+        Pixel p=src[i];
+        dst[4*i]=p>>24;
+        dst[4*i+1]=p>>16;
+        dst[4*i+2]=p>>8;
+        dst[4*i+3]=p;
+    }
+}
+
+// Convert n pixels to R G B bytes.
+static void pixels_to_rgb(const Pixel* src,unsigned char* dst,int n)
+{
+    int i=0;
+#if defined(__SSSE3__)
+    if(host_is_little_endian())
+    {
+        // Each group of four pixels produces 12 bytes; the 16-byte store spills
+        // four bytes that the next iteration overwrites, so stop one group early.
+        const __m128i pack=_mm_setr_epi8(3,2,1,7,6,5,11,10,9,15,14,13,-1,-1,-1,-1);
+        for(;i+8<=n;i+=4)
+        {
+            __m128i p=_mm_loadu_si128((const __m128i*)(src+i));
+            _mm_storeu_si128((__m128i*)(dst+3*i),_mm_shuffle_epi8(p,pack));
+        }
+    }
+#endif
+    for(;i<n;i++)
+    {
+        Pixel p=src[i];
+        dst[3*i]=p>>24;
+        dst[3*i+1]=p>>16;
+        dst[3*i+2]=p>>8;
+    }
+}
+
+static int zlib_strategy(png_strategy strategy)
+{
+    switch(strategy)
+    {
+        case png_strategy::filtered: return Z_FILTERED;
+        case png_strategy::huffman: return Z_HUFFMAN_ONLY;
+        case png_strategy::rle: return Z_RLE;
+        case png_strategy::fixed: return Z_FIXED;
+        default: return Z_DEFAULT_STRATEGY;
+    }
+}
+
+// Dump an image to file with libpng, on this thread.
+static void dump_png_single(Pixel* data,int width,int height,const char* filename,const output_options& options)
 {
+    TRACE_SCOPE("dump_png");
+
     FILE* file=fopen(filename,"wb");
     assert(file);
 
@@ -19,15 +122,332 @@ void dump_png(Pixel* data,int width,int height,const char* filename)
     int color_type=PNG_COLOR_TYPE_RGBA;
     png_set_IHDR(png_ptr,info_ptr,width,height,8,color_type,PNG_INTERLACE_NONE,PNG_COMPRESSION_TYPE_DEFAULT,PNG_FILTER_TYPE_DEFAULT);
 
-    Pixel** row_pointers=new Pixel*[height];
-    for(int j=0;j<height;j++) row_pointers[j]=data+width*(height-j-1);
-    png_set_rows(png_ptr,info_ptr,(png_byte**)row_pointers);
-    png_write_png(png_ptr,info_ptr,PNG_TRANSFORM_BGR|PNG_TRANSFORM_SWAP_ALPHA,0);
-    delete[] row_pointers;
+    png_set_compression_level(png_ptr,options.compression_level);
+    png_set_compression_strategy(png_ptr,zlib_strategy(options.strategy));
+    switch(options.filter)
+    {
+        case png_filter::adaptive: break;
+        case png_filter::none: png_set_filter(png_ptr,0,PNG_FILTER_NONE); break;
+        case png_filter::sub: png_set_filter(png_ptr,0,PNG_FILTER_SUB); break;
+        case png_filter::up: png_set_filter(png_ptr,0,PNG_FILTER_UP); break;
+        case png_filter::avg: png_set_filter(png_ptr,0,PNG_FILTER_AVG); break;
+        case png_filter::paeth: png_set_filter(png_ptr,0,PNG_FILTER_PAETH); break;
+    }
+    png_write_info(png_ptr,info_ptr);
+
+    // Convert one row at a time into RGBA bytes ourselves rather than asking
+    // libpng to apply BGR and alpha-swap transforms to every pixel.
+    std::vector<unsigned char> row(4*width);
+    for(int j=0;j<height;j++)
+    {
+        pixels_to_rgba(data+width*(height-j-1),&row[0],width);
+        png_write_row(png_ptr,&row[0]);
+    }
+    png_write_end(png_ptr,info_ptr);
     png_destroy_write_struct(&png_ptr,&info_ptr);
     fclose(file);
 }
 
+// Read filename back with read_png and check that it holds the pixels of data.
+// Exits with an error if it does not.
+static void verify_png(const Pixel* data,int width,int height,const char* filename)
+{
+    TRACE_SCOPE("verify_png");
+
+    Pixel* image=0;
+    int w=0,h=0;
+    read_png(image,w,h,filename);
+    bool same=w==width && h==height && !memcmp(image,data,sizeof(Pixel)*width*height);
+    delete [] image;
+    if(!same)
+    {
+        fprintf(stderr,"%s does not read back as the image that was written.\n",filename);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Dump an image to file.
+void dump_png(Pixel* data,int width,int height,const char* filename,const output_options& options)
+{
+    if(options.threads>1) dump_png_strips(data,width,height,filename,options);
+    else dump_png_single(data,width,height,filename,options);
+    if(options.verify) verify_png(data,width,height,filename);
+}
+
+static unsigned char paeth_predictor(int a,int b,int c)
+{
+    int p=a+b-c;
+    int pa=abs(p-a),pb=abs(p-b),pc=abs(p-c);
+    if(pa<=pb && pa<=pc) return a;
+    if(pb<=pc) return b;
+    return c;
+}
+
+// Apply PNG filter type (1-4, or 0 for none) to one row of RGBA bytes.  prev is
+// the unfiltered row above, or null for the first row of the image.  out
+// receives the filter type byte followed by the filtered row.
+static void filter_row(int type,const unsigned char* row,const unsigned char* prev,unsigned char* out,int bytes)
+{
+    const int bpp=4;
+    out[0]=type;
+    out++;
+    for(int x=0;x<bytes;x++)
+    {
+        int a=x>=bpp?row[x-bpp]:0;
+        int b=prev?prev[x]:0;
+        int c=prev && x>=bpp?prev[x-bpp]:0;
+        switch(type)
+        {
+            case 0: out[x]=row[x]; break;
+            case 1: out[x]=row[x]-a; break;
+            case 2: out[x]=row[x]-b; break;
+            case 3: out[x]=row[x]-((a+b)>>1); break;
+            case 4: out[x]=row[x]-paeth_predictor(a,b,c); break;
+        }
+    }
+}
+
+// Filter one row as requested by filter.  For png_filter::adaptive every
+// filter is tried and the one with the smallest sum of absolute (signed)
+// residuals is kept, which is the same heuristic libpng uses.
+static void filter_row(png_filter filter,const unsigned char* row,const unsigned char* prev,
+    unsigned char* out,unsigned char* scratch,int bytes)
+{
+    switch(filter)
+    {
+        case png_filter::none: filter_row(0,row,prev,out,bytes); return;
+        case png_filter::sub: filter_row(1,row,prev,out,bytes); return;
+        case png_filter::up: filter_row(2,row,prev,out,bytes); return;
+        case png_filter::avg: filter_row(3,row,prev,out,bytes); return;
+        case png_filter::paeth: filter_row(4,row,prev,out,bytes); return;
+        case png_filter::adaptive: break;
+    }
+    long best_sum=-1;
+    for(int type=0;type<5;type++)
+    {
+        filter_row(type,row,prev,scratch,bytes);
+        long sum=0;
+        for(int x=1;x<=bytes;x++) sum+=abs((signed char)scratch[x]);
+        if(best_sum<0 || sum<best_sum)
+        {
+            best_sum=sum;
+            memcpy(out,scratch,bytes+1);
+        }
+    }
+}
+
+// One horizontal strip of the image, filtered and deflated independently.
+struct png_strip
+{
+    int first_row;
+    int end_row;
+    std::vector<unsigned char> compressed;
+    unsigned long adler;
+    unsigned long length;
+};
+
+// Filter and deflate the rows of one strip as a raw deflate stream.  Strips
+// other than the last end with a full flush (so the stream is byte aligned and
+// does not reference earlier data) instead of a final block.
+static void deflate_strip(const Pixel* data,int width,int height,const output_options& options,
+    png_strip& strip,bool last)
+{
+    TRACE_SCOPE("deflate_strip","rows",strip.end_row-strip.first_row);
+
+    int bytes=4*width;
+    std::vector<unsigned char> row(bytes),prev(bytes),filtered(bytes+1),scratch(bytes+1);
+
+    z_stream stream;
+    memset(&stream,0,sizeof(stream));
+    int ret=deflateInit2(&stream,options.compression_level,Z_DEFLATED,-15,8,zlib_strategy(options.strategy));
+    assert(ret==Z_OK);
+
+    strip.adler=adler32(0,0,0);
+    strip.length=0;
+    strip.compressed.resize(deflateBound(&stream,(bytes+1)*(strip.end_row-strip.first_row))+16);
+    stream.next_out=&strip.compressed[0];
+    stream.avail_out=strip.compressed.size();
+
+    if(strip.first_row>0)
+        pixels_to_rgba(data+width*(height-strip.first_row),&prev[0],width);
+    for(int j=strip.first_row;j<strip.end_row;j++)
+    {
+        pixels_to_rgba(data+width*(height-j-1),&row[0],width);
+        filter_row(options.filter,&row[0],j>0?&prev[0]:0,&filtered[0],&scratch[0],bytes);
+        strip.adler=adler32(strip.adler,&filtered[0],bytes+1);
+        strip.length+=bytes+1;
+
+        stream.next_in=&filtered[0];
+        stream.avail_in=bytes+1;
+        ret=deflate(&stream,Z_NO_FLUSH);
+        assert(ret!=Z_STREAM_ERROR && stream.avail_in==0);
+        row.swap(prev);
+    }
+
+    // End the strip after its rows, so that a strip with none still finishes
+    // the stream if it is the last.
+    stream.avail_in=0;
+    ret=deflate(&stream,last?Z_FINISH:Z_FULL_FLUSH);
+    assert(ret==(last?Z_STREAM_END:Z_OK));
+    assert(stream.avail_out>0);
+    strip.compressed.resize(strip.compressed.size()-stream.avail_out);
+    deflateEnd(&stream);
+}
+
+// Write one PNG chunk (length, type, data, CRC of type and data).
+static void write_chunk(FILE* file,const char* type,const unsigned char* data,unsigned long length)
+{
+    unsigned char header[8]={(unsigned char)(length>>24),(unsigned char)(length>>16),
+        (unsigned char)(length>>8),(unsigned char)length,
+        (unsigned char)type[0],(unsigned char)type[1],(unsigned char)type[2],(unsigned char)type[3]};
+    unsigned long crc=crc32(0,header+4,4);
+    if(length) crc=crc32(crc,data,length);
+    unsigned char footer[4]={(unsigned char)(crc>>24),(unsigned char)(crc>>16),(unsigned char)(crc>>8),(unsigned char)crc};
+    fwrite(header,1,8,file);
+    if(length) fwrite(data,1,length,file);
+    fwrite(footer,1,4,file);
+}
+
+// Dump an image to file, deflating strips of rows on separate threads.
+void dump_png_strips(Pixel* data,int width,int height,const char* filename,const output_options& options)
+{
+    TRACE_SCOPE("dump_png","threads",options.threads);
+
+    FILE* file=fopen(filename,"wb");
+    assert(file);
+
+    int num_strips=std::max(1,std::min(options.threads,height));
+    std::vector<png_strip> strips(num_strips);
+    for(int s=0;s<num_strips;s++)
+    {
+        strips[s].first_row=(long long)height*s/num_strips;
+        strips[s].end_row=(long long)height*(s+1)/num_strips;
+    }
+
+    std::vector<std::thread> workers;
+    for(int s=1;s<num_strips;s++)
+        workers.push_back(std::thread(deflate_strip,data,width,height,std::cref(options),
+            std::ref(strips[s]),s+1==num_strips));
+    deflate_strip(data,width,height,options,strips[0],num_strips==1);
+    for(size_t t=0;t<workers.size();t++) workers[t].join();
+
+    // Stitch the strips into one zlib stream: a zlib header, the raw deflate
+    // data of every strip and the Adler-32 of all of the uncompressed data.
+    int level=options.compression_level;
+    unsigned char flevel=level<2?0:level<6?1:level==6?2:3;
+    unsigned char cmf=0x78;
+    unsigned char flg=flevel<<6;
+    flg+=31-(cmf*256+flg)%31;
+    std::vector<unsigned char> idat;
+    idat.push_back(cmf);
+    idat.push_back(flg);
+    unsigned long adler=strips[0].adler;
+    for(int s=0;s<num_strips;s++)
+    {
+        idat.insert(idat.end(),strips[s].compressed.begin(),strips[s].compressed.end());
+        if(s>0) adler=adler32_combine(adler,strips[s].adler,strips[s].length);
+    }
+    for(int shift=24;shift>=0;shift-=8) idat.push_back(adler>>shift);
+
+    static const unsigned char signature[8]={137,80,78,71,13,10,26,10};
+    unsigned char ihdr[13]={(unsigned char)(width>>24),(unsigned char)(width>>16),
+        (unsigned char)(width>>8),(unsigned char)width,
+        (unsigned char)(height>>24),(unsigned char)(height>>16),
+        (unsigned char)(height>>8),(unsigned char)height,
+        8,PNG_COLOR_TYPE_RGBA,0,0,0};
+    fwrite(signature,1,8,file);
+    write_chunk(file,"IHDR",ihdr,13);
+    write_chunk(file,"IDAT",&idat[0],idat.size());
+    write_chunk(file,"IEND",0,0);
+    fclose(file);
+}
+
+// Dump an image to file as binary PPM (or PAM, if alpha is set).
+void dump_pnm(Pixel* data,int width,int height,const char* filename,bool alpha)
+{
+    TRACE_SCOPE("dump_pnm");
+
+    FILE* file=fopen(filename,"wb");
+    assert(file);
+
+    if(alpha) fprintf(file,"P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",width,height);
+    else fprintf(file,"P6\n%d %d\n255\n",width,height);
+
+    int channels=alpha?4:3;
+    std::vector<unsigned char> row(channels*width);
+    for(int j=0;j<height;j++)
+    {
+        if(alpha) pixels_to_rgba(data+width*(height-j-1),&row[0],width);
+        else pixels_to_rgb(data+width*(height-j-1),&row[0],width);
+        fwrite(&row[0],1,row.size(),file);
+    }
+    fclose(file);
+}
+
+// Write a float image as PFM.  PFM stores rows bottom-up, like data, and a
+// negative scale marks the floats as little-endian.
+void dump_pfm(const float* data,int width,int height,int channels,const char* filename)
+{
+    TRACE_SCOPE("dump_pfm");
+
+    FILE* file=fopen(filename,"wb");
+    assert(file);
+    assert(channels==1 || channels==3);
+
+    unsigned int one=1;
+    bool little_endian=*(unsigned char*)&one;
+    fprintf(file,"%s\n%d %d\n%s\n",channels==3?"PF":"Pf",width,height,little_endian?"-1.0":"1.0");
+    fwrite(data,sizeof(float),(size_t)width*height*channels,file);
+    fclose(file);
+}
+
+// Dump an image to file, choosing the writer from options.format.
+void dump_image(Pixel* data,int width,int height,const char* basename,const output_options& options)
+{
+    std::string filename=basename;
+    switch(options.format)
+    {
+        case image_format::png: dump_png(data,width,height,(filename+".png").c_str(),options); break;
+        case image_format::ppm: dump_pnm(data,width,height,(filename+".ppm").c_str(),false); break;
+        case image_format::pam: dump_pnm(data,width,height,(filename+".pam").c_str(),true); break;
+    }
+}
+
+bool parse_image_format(const char* name, image_format& format)
+{
+    std::string s=name;
+    if(s=="png") format=image_format::png;
+    else if(s=="ppm") format=image_format::ppm;
+    else if(s=="pam") format=image_format::pam;
+    else return false;
+    return true;
+}
+
+bool parse_png_strategy(const char* name, png_strategy& strategy)
+{
+    std::string s=name;
+    if(s=="default") strategy=png_strategy::standard;
+    else if(s=="filtered") strategy=png_strategy::filtered;
+    else if(s=="huffman") strategy=png_strategy::huffman;
+    else if(s=="rle") strategy=png_strategy::rle;
+    else if(s=="fixed") strategy=png_strategy::fixed;
+    else return false;
+    return true;
+}
+
+bool parse_png_filter(const char* name, png_filter& filter)
+{
+    std::string s=name;
+    if(s=="adaptive") filter=png_filter::adaptive;
+    else if(s=="none") filter=png_filter::none;
+    else if(s=="sub") filter=png_filter::sub;
+    else if(s=="up") filter=png_filter::up;
+    else if(s=="avg") filter=png_filter::avg;
+    else if(s=="paeth") filter=png_filter::paeth;
+    else return false;
+    return true;
+}
+
 // Read an image from file.
 void read_png(Pixel*& data,int& width,int& height,const char* filename)
 {
@@ -66,17 +486,18 @@ void read_png(Pixel*& data,int& width,int& height,const char* filename)
     if(bit_depth < 8)
         png_set_packing(png_ptr);
     
-    if(color_type == PNG_COLOR_TYPE_GRAY_ALPHA || color_type == PNG_COLOR_TYPE_RGB_ALPHA)
+    // Rows are read as A, B, G, R bytes, which is 0xRRGGBBAA in a
+    // little-endian int.  Images without alpha get an opaque filler byte.
+    bool alpha = (color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS);
+    if(alpha)
         png_set_swap_alpha(png_ptr);
+    else
+        png_set_filler(png_ptr, 0xff, PNG_FILLER_BEFORE);
 
     if(color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
         png_set_gray_to_rgb(png_ptr);
 
-    if(color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_RGB_ALPHA)
-        png_set_bgr(png_ptr);
-
-    if(color_type == PNG_COLOR_TYPE_RGB)
-        png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
+    png_set_bgr(png_ptr);
 
     height = png_get_image_height(png_ptr, info_ptr);
 
@@ -0,0 +1,80 @@
+#ifndef __DUMP_PNG__
+#define __DUMP_PNG__
+
+#include "common.h"
+
+// File formats the output stage can produce.
+//   image_format::png - RGBA PNG, compressed according to the options below.
+//   image_format::ppm - binary PPM (P6), raw RGB bytes with no compression.
+//   image_format::pam - PAM (P7) with TUPLTYPE RGB_ALPHA, raw RGBA bytes.
+// The raw formats are meant for pipelines that post-process frames and do not
+// want to pay for deflate.
+enum class image_format {png, ppm, pam};
+
+// Deflate strategy used for PNG output.  These map onto the zlib strategies of
+// the same name; rle and huffman are much faster than standard and still
+// compress flat-shaded renders well.
+enum class png_strategy {standard, filtered, huffman, rle, fixed};
+
+// Row filter used for PNG output.  adaptive lets libpng try every filter on
+// each row and keep the best one (the libpng default); the single filters skip
+// that search, with none being the cheapest.
+enum class png_filter {adaptive, none, sub, up, avg, paeth};
+
+// Settings for the output stage.  The defaults reproduce libpng's defaults.
+struct output_options
+{
+    image_format format = image_format::png;
+
+    // zlib compression level, 0-9.  Level 0 stores the data uncompressed.
+    int compression_level = 6;
+    png_strategy strategy = png_strategy::standard;
+    png_filter filter = png_filter::adaptive;
+
+    // Number of threads used to deflate PNG data.  With more than one thread
+    // the rows are split into that many strips, each deflated independently
+    // and stitched into a single IDAT stream (see dump_png_strips).
+    int threads = 1;
+
+    // Read each PNG back with read_png after writing it and check that it
+    // decodes to the pixels that were written.
+    bool verify = false;
+};
+
+// Write an image to filename in the PNG format.  Rows are stored bottom-up in
+// data (see driver_state::image_color).  With options.verify the file is read
+// back, and the program exits with an error if the pixels differ.
+void dump_png(pixel* data,int width,int height,const char* filename,
+    const output_options& options=output_options());
+
+// Write an image to filename in the PNG format, deflating options.threads
+// horizontal strips in parallel.  Each strip ends with a full flush, so the
+// strips concatenate into one valid zlib stream that any PNG reader accepts.
+// The result is not byte-identical to dump_png's, but decodes to the same
+// pixels.
+void dump_png_strips(pixel* data,int width,int height,const char* filename,
+    const output_options& options);
+
+// Write an image to filename as binary PPM, or as PAM if alpha is true.
+void dump_pnm(pixel* data,int width,int height,const char* filename,bool alpha);
+
+// Write a float image to filename as PFM, with 1 (grayscale) or 3 (RGB)
+// channels per pixel.  Rows are stored bottom-up in data.
+void dump_pfm(const float* data,int width,int height,int channels,const char* filename);
+
+// Write an image according to options.format.  The extension matching the
+// format (.png, .ppm or .pam) is appended to basename.
+void dump_image(pixel* data,int width,int height,const char* basename,
+    const output_options& options);
+
+// Read an image from file.  data is allocated with new[] and must be released
+// with delete[] by the caller.
+void read_png(pixel*& data,int& width,int& height,const char* filename);
+
+// Parse the names used on the command line for the enums above.  Each returns
+// false if the name is not recognized.
+bool parse_image_format(const char* name, image_format& format);
+bool parse_png_strategy(const char* name, png_strategy& strategy);
+bool parse_png_filter(const char* name, png_filter& filter);
+
+#endif
@@ -1,6 +1,10 @@
-#!/usr/bin/python
+#!/usr/bin/env python3
 
 # ./grading-script.py <test-dir>
+#
+# Each test runs in its own ./driver process so that crashes and timeouts are
+# caught per test.  For a quick in-process run of the whole suite, use
+# ./driver -b grading-scheme.txt -j <threads> instead.
 
 import os,re,sys,shutil,random,subprocess,threading
 
@@ -14,7 +18,7 @@ except:
     pass
 os.mkdir(dir)
 
-re_cp=re.compile('\.h$|\.cpp$|^SConstruct$')
+re_cp=re.compile(r'\.h$|\.cpp$|^CMakeLists\.txt$')
 for f in os.listdir('.'):
     if re_cp.search(f):
         shutil.copyfile(f, dir+"/"+f)
@@ -22,7 +26,7 @@ for f in os.listdir('.'):
 # Discourage cheating
 token='TOKEN'+str(random.randrange(100000,999999))
 
-if subprocess.call('scons',cwd=dir)!=0:
+if subprocess.call(['cmake','.'],cwd=dir)!=0 or subprocess.call(['make'],cwd=dir)!=0:
     print("FAIL: Did not compile")
     exit()
 
@@ -34,7 +38,7 @@ def run_command_with_timeout(cmd, timeout_sec):
     if proc_thread.is_alive():
         try:
             proc.kill()
-        except OSError, e:
+        except OSError:
             return True
         return False
     return True
@@ -42,8 +46,8 @@ def run_command_with_timeout(cmd, timeout_sec):
 hashed_tests={}
 total_score=0
 
-ignore_line=re.compile('^\s*(#|$)')
-grade_line=re.compile('^(\S+)\s+(\S+)\s+(\S+)\s+(\S+)\s*$')
+ignore_line=re.compile(r'^\s*(#|$)')
+grade_line=re.compile(r'^(\S+)\s+(\S+)\s+(\S+)\s+(\S+)((?:\s+\S+)*)\s*$')
 gs=0
 try:
     gs=open('grading-scheme.txt')
@@ -51,7 +55,7 @@ except:
     print("FAIL: could not open grading scheme.")
     exit()
 
-diff_parse=re.compile('diff: (.*)')
+diff_parse=re.compile(r'diff: (.*)')
 grade_cmd=['./driver', '-i', 'file.txt', '-s', 'file.png', '-o', token+'.txt']
 
 for line in gs.readlines():
@@ -66,14 +70,18 @@ for line in gs.readlines():
     max_time=float(g.groups()[2])
     file=g.groups()[3]
 
+    # Any render options that follow, such as -M, are passed to the driver.
+    options=g.groups()[4].split()
+    test=" ".join([file]+options)
+
     pass_error = 0
     pass_time = 0
-    if not hashed_tests.has_key(file):
+    if test not in hashed_tests:
         timeout = max(int(max_time*1.2*3/1000)+1,2)
         shutil.copyfile(test_dir+'/'+file+".txt", dir+"/file.txt")
         shutil.copyfile(test_dir+'/'+file+".png", dir+"/file.png")
-        if not run_command_with_timeout(grade_cmd, timeout):
-            hashed_tests[file]=("TIMEOUT",None)
+        if not run_command_with_timeout(grade_cmd+options, timeout):
+            hashed_tests[test]=("TIMEOUT",None)
         else:
             try:
                 report=dir+'/'+token+'.txt'
@@ -83,23 +91,23 @@ for line in gs.readlines():
                 if os.path.isfile(report):
                     os.remove(report) # remove the diff file
                 if d: d=float(d.groups()[0])
-                hashed_tests[file]=d
+                hashed_tests[test]=d
             except:
-                hashed_tests[file]=(None,None)
+                hashed_tests[test]=(None,None)
 
-    d=hashed_tests[file]
+    d=hashed_tests[test]
     if d=="TIMEOUT":
-        print("FAIL: (%s) Test timed out."%file)
+        print("FAIL: (%s) Test timed out."%test)
         points=0
     elif d==None:
-        print("FAIL: (%s) Program failed to report statistics."%file)
+        print("FAIL: (%s) Program failed to report statistics."%test)
         points=0
     else:
         if d>max_error:
-            print("FAIL: (%s) Too much error. Actual: %s  Max: %s."%(file,d,max_error))
+            print("FAIL: (%s) Too much error. Actual: %s  Max: %s."%(test,d,max_error))
             points=0
         else:
-            print("PASS: (%s) diff %g vs %g."%(file,d,max_error))
+            print("PASS: (%s) diff %g vs %g."%(test,d,max_error))
 
     if points>0:
         print("+%g points"%points)
@@ -3,10 +3,28 @@
  * -------------------------------
  * This is simple testbed for your GLSL implementation.
  *
- * Usage: ./driver -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ]
+ * Usage: ./driver -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ] [ -t <trace-file> ]
+ *                [ -d <max-error> ] [ -e <format> ] [ -z <level> ] [ -Z <strategy> ] [ -F <filter> ] [ -V ]
+ *                [ -j <threads> ] [ -c ] [ -r <raster-mode> ] [ -m <samples> ] [ -D <depth-format> ] [ -O ] [ -S ] [ -M ]
+ *                [ -f <frames> ] [ -p <workers> ] [ -P <workers> ]
+ *        ./driver -b <manifest-file> [ -o <stats-file> ] [ -j <threads> ] [ -r <raster-mode> ]
+ *                [ -m <samples> ] [ -D <depth-format> ] [ -O ] [ -S ] [ -M ]
  *     <input-file>      File with commands to run
+ *     <manifest-file>   List of tests to run, in the format of grading-scheme.txt
  *     <solution-file>   File with solution to compare with
  *     <stats-file>      Dump statistics to this file rather than stdout
+ *     <trace-file>      Write a Chrome trace-event timeline to this file
+ *     <max-error>       Write diff.png if the difference exceeds this
+ *     <format>          Output format: png (default), ppm or pam
+ *     <level>           PNG compression level, 0 (stored) to 9; default 6
+ *     <strategy>        PNG deflate strategy: default, filtered, huffman, rle, fixed
+ *     <filter>          PNG row filter: adaptive (default), none, sub, up, avg, paeth
+ *     <threads>         Number of worker threads; default 1
+ *     <raster-mode>     Rasterizer: float (default), fixed or homogeneous
+ *     <samples>         Samples per pixel for anti-aliasing: 1 (default), 2, 4 or 8
+ *     <depth-format>    Depth buffer format: float32 (default), unorm16, unorm24, reversed
+ *     <frames>          Number of frames to render in a camera flythrough
+ *     <workers>         Number of worker processes for distributed rendering
  *
  * Only the -i is manditory.  You must specify a test to run.  For example:
  *
@@ -18,13 +36,99 @@
  * ./driver -i 00.txt -s 00.png
  *
  * This will compute and output a measure of the difference ("diff: 0.23"); to
- * pass a test this error must be below the test's threshold.  An image is
- * output to diff.png which visually shows where the differences are in the
- * results, which can help you track down any differences.
+ * pass a test this error must be below the test's threshold.  The lines that
+ * follow report the largest per-pixel error ("max: 12"), the number of pixels
+ * that differ at all ("pixels: 40") and the PSNR in dB ("psnr: 51.32").  Adding
+ * "-d 1" writes diff.png, which visually shows where the differences are in the
+ * results, whenever the difference exceeds 1; this can help you track down
+ * any differences.
+ *
+ * The -r flag selects the rasterizer.  "fixed" snaps vertices to a 16.8
+ * fixed-point grid and applies the top-left fill rule, so pixels on edges
+ * shared by two triangles are shaded once instead of twice.  "homogeneous"
+ * rasterizes triangles straight from their clip-space coordinates, without
+ * clipping them first, in the manner of Olano and Greer.
+ *
+ * The -m flag turns on multisample anti-aliasing.  Coverage and depth are
+ * tested at each of the standard 2, 4 or 8 sample positions, the fragment
+ * shader runs once per pixel per triangle, and the samples are averaged when
+ * the scene is done.  Multisampling uses its own rasterizer, so -r is ignored
+ * while it is on.
+ *
+ * The -D flag selects how the depth buffer is stored.  "unorm16" halves the
+ * depth buffer's size and memory traffic compared to the default 32-bit float,
+ * "unorm24" packs 24 bits of normalized depth into 3 bytes per pixel, and
+ * "reversed" stores floats with the near plane at 1 and the far plane at 0.
+ *
+ * The -O flag runs the mesh optimizer on indexed renders: triangles are
+ * reordered for the post-transform vertex cache, then drawn in clusters from
+ * front to back so that more fragments fail the depth test.  With -c the
+ * average cache miss ratio (vertex shader runs per triangle) and the estimated
+ * overdraw are reported before and after.
+ *
+ * The -S flag draws the triangles of each opaque render nearest first, so that
+ * the depth test rejects more fragments before they are shaded; -c reports
+ * the number of fragments shaded.  Ties in depth are resolved in submission
+ * order, so the image is the same as without -S.
+ *
+ * The -M flag splits indexed renders into meshlets of up to 64 vertices and
+ * 126 triangles, and skips the meshlets that lie outside of the view or, with
+ * culling on, face away from it, before any of their vertices are shaded.
+ * Meshlets of buffer objects are built once and reused.  Building meshlets
+ * reorders the triangles of a render, so, as with -O, -c may report a
+ * different number of fragments shaded, and the winner between fragments of
+ * equal depth may change.
+ *
+ * The -f flag benchmarks a camera flythrough.  The scene is parsed once into
+ * a command buffer, which is then replayed <frames> times with the camera
+ * swaying up to 30 degrees left and right about the y axis.  Each draw's
+ * uniforms are assumed to start with its transform, as for the transform and
+ * color shaders.  The last frame uses the scene's own camera, so it can be
+ * compared with -s as usual, and the average time per frame is reported.  -c
+ * reports the counters of the last frame.
+ *
+ * The -p flag renders with <workers> processes, sort first: each renders one
+ * band of rows of the image and of any render targets, and sends them back
+ * to be composited.  Rendering time and the time of each worker are
+ * reported, and -c sums the counters of all workers.  -P measures how this
+ * scales, rendering with 1, 2, 4, ... up to <workers> processes and reporting
+ * the speedup of each over one.  The image is the one rendered by the most
+ * workers.  Scenes that use occlusion queries cannot be split, and are
+ * rejected before rendering with more than one worker.
  *
  * The -o flag is used for the grading script, so that grading will not be
- * confused by debug print statements.
+ * confused by debug print statements.  The -c flag appends the pipeline's
+ * counters (triangles assembled, culled, ...) to the statistics.
+ *
+ * The -b flag runs a whole test suite in one process instead:
+ *
+ * ./driver -b grading-scheme.txt -j 4
+ *
+ * Every test in the manifest is rendered and compared against its reference
+ * image, spread over the -j worker threads, and one PASS/FAIL line with the
+ * diff and render time is reported per test.  Render options given on the
+ * command line apply to every test; those after a test in the manifest, such
+ * as -M, apply to that test only.
+ *
+ * The -t flag records scoped timers around parsing, each render, the vertex,
+ * clipping and rasterization stages and PNG output.  Open the resulting file in
+ * chrome://tracing or ui.perfetto.dev.  Tracing must be compiled in with
+ * cmake -DDRIVER_TRACE=ON; otherwise -t only prints a warning.
+ *
+ * The remaining flags control how output.png is written.  Encoding a PNG can
+ * take longer than rendering it; "-z 1 -F none" or "-Z rle" are much cheaper
+ * than the defaults, "-z 0" writes uncompressed data, and "-e ppm" / "-e pam"
+ * skip PNG entirely and write output.ppm / output.pam instead.  With -j, PNG
+ * rows are split into one strip per thread and the strips are deflated in
+ * parallel, which pays off for large (4K and up) frames.  -V reads each PNG
+ * back with read_png and exits with an error unless it decodes to the pixels
+ * that were rendered, which checks the strip encoder against libpng's reader.
+ *
+ * Scenes that enable extra render targets with the "target" command get one
+ * more file per target: output_1.png and so on for rgba8 targets (following
+ * -e like output.png), and output_1.pfm and so on for rgba16f and r32f targets.
  */
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <cstdlib>
@@ -32,77 +136,144 @@
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <string>
 #include <vector>
 #include <chrono>
+#include "batch.h"
+#include "command.h"
+#include "compare.h"
+#include "distribute.h"
 #include "driver_state.h"
+#include "dump_png.h"
+#include "mat.h"
+#include "pack.h"
+#include "trace.h"
 #include <unistd.h>
 
 void parse(const char* test_file, driver_state& state);
-void dump_png(pixel* data,int width,int height,const char* filename);
-void read_png(pixel*& data,int& width,int& height,const char* filename);
 
-// Compare the computed solution (in state) to the solution_file
-void compare(driver_state& state, FILE* stats_file, const char* solution_file)
+// Compare the computed solution (in state) to the solution_file.  If
+// diff_threshold is not negative and the error exceeds it, an image showing
+// where the results differ is written to diff.png.
+void compare(driver_state& state, FILE* stats_file, const char* solution_file,
+    double diff_threshold, int threads)
 {
-    // Allocate and initialize space for the solution and difference images
-    int width_sol = 0;
-    int height_sol = 0;
-    int size = state.image_width*state.image_height;
-    pixel* image_diff = new pixel[size];
-    pixel* image_sol = new pixel[size];
-    pixel black = make_pixel(0,0,0);
-    for(int i=0;i<size;i++)
-    {
-        image_sol[i]=black;
-        image_diff[i]=black;
-    }
+    TRACE_SCOPE("compare");
 
     // Read the solution file, do some sanity checks.
+    int width_sol = 0;
+    int height_sol = 0;
+    pixel* image_sol = 0;
     read_png(image_sol, width_sol, height_sol, solution_file);
     if(state.image_width!=width_sol || state.image_height!=height_sol)
     {
         std::cerr<<"Solution dimensions ("<<width_sol<<","<<height_sol
                  <<") do not match problem size ("
                  <<state.image_width<<","<<state.image_height<<")"<<std::endl;
-        delete [] image_diff;
         delete [] image_sol;
         exit(EXIT_FAILURE);
     }
 
-    // Compare the computed an solution images pixel by pixel
-    int total_diff = 0;
-    for(int i=0;i<size;i++)
-    {
-        int A=image_sol[i];
-        int B=state.image_color[i];
-        int rA,gA,bA,rB,gB,bB;
-        from_pixel(A,rA,gA,bA);
-        from_pixel(B,rB,gB,bB);
-        int r=abs(rA-rB);
-        int g=abs(gA-gB);
-        int b=abs(bA-bB);
-        int diff=std::max(std::max(r,g),b);
-        total_diff += diff;
-        pixel diff_color=make_pixel(diff, diff, diff);
-        image_diff[i]=diff_color;
-    }
+    // Compare the computed and solution images
+    long size = (long)state.image_width*state.image_height;
+    compare_result result = compare_images(image_sol, state.image_color, size, threads);
 
     // Dump out the difference so we can see visually what is different
-    dump_png(image_diff,state.image_width,state.image_height,"diff.png");
+    if(diff_threshold >= 0 && result.mean_error > diff_threshold)
+    {
+        pixel* image_diff = new pixel[size];
+        make_diff_image(image_sol, state.image_color, size, image_diff);
+        dump_png(image_diff,state.image_width,state.image_height,"diff.png");
+        delete [] image_diff;
+    }
 
-    // Dump out stats so we can determine whether we are close enough
-    fprintf(stats_file, "diff: %.2f\n",total_diff/(2.55*size));
-    delete [] image_diff;
+    // Dump out stats so we can determine whether we are close enough.  The
+    // grading script only reads the first line.
+    fprintf(stats_file, "diff: %.2f\n",result.mean_error);
+    fprintf(stats_file, "max: %d\n",result.max_error);
+    fprintf(stats_file, "pixels: %ld\n",result.differing_pixels);
+    fprintf(stats_file, "psnr: %.2f\n",result.psnr);
     delete [] image_sol;
 }
 
+// Save each enabled render target as output_<index>.  rgba8 targets are
+// written like the image; float targets are written as PFM, RGB for rgba16f
+// (alpha is dropped) and grayscale for r32f.
+void dump_render_targets(const driver_state& state, const output_options& output)
+{
+    int size=state.image_width*state.image_height;
+    for(int i=0;i<MAX_RENDER_TARGETS-1;i++)
+    {
+        const render_target& target=state.targets[i];
+        std::string basename="output_"+std::to_string(i+1);
+        if(target.format==target_format::rgba8)
+        {
+            dump_image((pixel*)target.data,state.image_width,state.image_height,basename.c_str(),output);
+        }
+        else if(target.format==target_format::rgba16f)
+        {
+            const unsigned short* half=(const unsigned short*)target.data;
+            std::vector<float> rgb(3*size);
+            for(int k=0;k<size;k++)
+                for(int c=0;c<3;c++)
+                    rgb[3*k+c]=half_to_float(half[4*k+c]);
+            dump_pfm(&rgb[0],state.image_width,state.image_height,3,(basename+".pfm").c_str());
+        }
+        else if(target.format==target_format::r32f)
+        {
+            dump_pfm((const float*)target.data,state.image_width,state.image_height,1,(basename+".pfm").c_str());
+        }
+    }
+}
+
+// Largest angle, in degrees, that the camera of a flythrough turns by.
+static const double FLYTHROUGH_SWAY = 30;
+
+// Turn the camera of a draw by angle radians about the y axis of the scene's
+// coordinates, by following the transform at the start of its uniforms with a
+// rotation.
+void rotate_camera(std::vector<float>& uniform, double angle)
+{
+    if(uniform.size()<16) return;
+    mat4 rotation;
+    rotation.make_id();
+    rotation(0,0) = rotation(2,2) = cos(angle);
+    rotation(0,2) = sin(angle);
+    rotation(2,0) = -sin(angle);
+    const mat4& xform = *(const mat4*)&uniform[0];
+    mat4 result;
+    for(int i=0;i<4;i++)
+        for(int j=0;j<4;j++)
+            for(int k=0;k<4;k++)
+                result(i,j) += xform(i,k)*rotation(k,j);
+    std::copy(result.x, result.x+16, uniform.begin());
+}
+
 // Provide assistance in calling this program
 void Usage(const char* prog_name)
 {
-    std::cerr<<"Usage: "<<prog_name<<" -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ]"<<std::endl;
+    std::cerr<<"Usage: "<<prog_name<<" -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ] [ -t <trace-file> ]"<<std::endl;
+    std::cerr<<"           [ -d <max-error> ] [ -e <format> ] [ -z <level> ] [ -Z <strategy> ] [ -F <filter> ] [ -V ]"<<std::endl;
+    std::cerr<<"           [ -j <threads> ] [ -c ] [ -r <raster-mode> ] [ -m <samples> ] [ -D <depth-format> ] [ -O ] [ -S ] [ -M ]"<<std::endl;
+    std::cerr<<"           [ -f <frames> ] [ -p <workers> ] [ -P <workers> ]"<<std::endl;
+    std::cerr<<"       "<<prog_name<<" -b <manifest-file> [ -o <stats-file> ] [ -j <threads> ] [ -r <raster-mode> ]"<<std::endl;
+    std::cerr<<"           [ -m <samples> ] [ -D <depth-format> ] [ -O ] [ -S ] [ -M ]"<<std::endl;
     std::cerr<<"    <input-file>      File with commands to run"<<std::endl;
+    std::cerr<<"    <manifest-file>   List of tests to run, in the format of grading-scheme.txt"<<std::endl;
     std::cerr<<"    <solution-file>   File with solution to compare with"<<std::endl;
     std::cerr<<"    <stats-file>      Dump statistics to this file rather than stdout"<<std::endl;
+    std::cerr<<"    <trace-file>      Write a Chrome trace-event timeline to this file"<<std::endl;
+    std::cerr<<"    <max-error>       Write diff.png if the difference exceeds this"<<std::endl;
+    std::cerr<<"    <format>          Output format: png (default), ppm or pam"<<std::endl;
+    std::cerr<<"    <level>           PNG compression level, 0 (stored) to 9; default 6"<<std::endl;
+    std::cerr<<"    <strategy>        PNG deflate strategy: default, filtered, huffman, rle, fixed"<<std::endl;
+    std::cerr<<"    <filter>          PNG row filter: adaptive (default), none, sub, up, avg, paeth"<<std::endl;
+    std::cerr<<"    <threads>         Number of worker threads; default 1"<<std::endl;
+    std::cerr<<"    <raster-mode>     Rasterizer: float (default), fixed or homogeneous"<<std::endl;
+    std::cerr<<"    <samples>         Samples per pixel for anti-aliasing: 1 (default), 2, 4 or 8"<<std::endl;
+    std::cerr<<"    <depth-format>    Depth buffer format: float32 (default), unorm16, unorm24, reversed"<<std::endl;
+    std::cerr<<"    <frames>          Number of frames to render in a camera flythrough"<<std::endl;
+    std::cerr<<"    <workers>         Number of worker processes for distributed rendering"<<std::endl;
     exit(EXIT_FAILURE);
 }
 
@@ -110,43 +281,163 @@ int main(int argc, char** argv)
 {
     const char* solution_file = 0;
     const char* input_file = 0;
+    const char* manifest_file = 0;
     const char* statistics_file = 0;
+    const char* trace_file = 0;
+    double diff_threshold = -1;
+    bool print_counters = false;
+    int threads = 1;
+    int frames = 0;
+    int workers = 0;
+    bool scaling = false;
+    output_options output;
     
     driver_state state;
 
     // Parse commandline options
     while(1)
     {
-        int opt = getopt(argc, argv, "s:i:o:");
+        int opt = getopt(argc, argv, "s:i:b:o:t:d:e:z:Z:F:Vj:cf:p:P:" RENDER_CONFIG_OPTIONS);
         if(opt==-1) break;
         switch(opt)
         {
             case 's': solution_file = optarg; break;
             case 'i': input_file = optarg; break;
+            case 'b': manifest_file = optarg; break;
             case 'o': statistics_file = optarg; break;
+            case 't': trace_file = optarg; break;
+            case 'd': diff_threshold = atof(optarg); break;
+            case 'c': print_counters = true; break;
+            case 'r': case 'm': case 'D': case 'O': case 'S': case 'M':
+                if(!parse_render_option(opt, optarg, state.config)) Usage(argv[0]);
+                break;
+            case 'f':
+                frames = atoi(optarg);
+                if(frames<1) Usage(argv[0]);
+                break;
+            case 'p':
+            case 'P':
+                workers = atoi(optarg);
+                scaling = opt=='P';
+                if(workers<1) Usage(argv[0]);
+                break;
+            case 'e': if(!parse_image_format(optarg, output.format)) Usage(argv[0]); break;
+            case 'z':
+                output.compression_level = atoi(optarg);
+                if(output.compression_level<0 || output.compression_level>9) Usage(argv[0]);
+                break;
+            case 'Z': if(!parse_png_strategy(optarg, output.strategy)) Usage(argv[0]); break;
+            case 'F': if(!parse_png_filter(optarg, output.filter)) Usage(argv[0]); break;
+            case 'V': output.verify = true; break;
+            case 'j':
+                threads = atoi(optarg);
+                if(threads<1) Usage(argv[0]);
+                break;
+            default: Usage(argv[0]);
         }
     }
 
     // Sanity checks
-    if(!input_file)
+    if(!input_file && !manifest_file)
     {
         std::cerr<<"Test file required.  Use -i."<<std::endl;
         Usage(argv[0]);
     }
 
-    // Parse the input file, setup state, request renders
-    parse(input_file, state);
+    output.threads = threads;
+    state.config.threads = threads;
+
+    // Start recording the timeline before any work is done
+    if(trace_file && !trace_enable())
+    {
+        std::cerr<<"Tracing is not compiled in; rebuild with -DDRIVER_TRACE=ON."<<std::endl;
+        trace_file = 0;
+    }
+
+    // Run a whole test suite if requested
+    if(manifest_file)
+    {
+        FILE* stats_file = stdout;
+        if(statistics_file) stats_file = fopen(statistics_file, "w");
+        bool passed = run_batch(manifest_file, threads, state.config, stats_file);
+        if(stats_file != stdout) fclose(stats_file);
+        if(trace_file) trace_write(trace_file);
+        return passed ? 0 : EXIT_FAILURE;
+    }
+
+    // Parse the input file, setup state, request renders.  A flythrough
+    // parses the file once and replays it for every frame.
+    double frame_ms = 0;
+    std::vector<double> worker_ms, distributed_ms;
+    std::vector<int> worker_counts;
+    if(frames)
+    {
+        std::vector<command> commands;
+        record_scene(input_file, commands);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for(int f=1;f<=frames;f++)
+        {
+            double angle = FLYTHROUGH_SWAY*M_PI/180*sin(2*M_PI*(f%frames)/frames);
+            if(angle) replay_scene(state, commands, [angle](std::vector<float>& u) { rotate_camera(u, angle); });
+            else replay_scene(state, commands);
+        }
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        frame_ms = std::chrono::duration<double, std::milli>(end - start).count()/frames;
+    }
+    else if(workers)
+    {
+        // With -P, time each power of two up to the requested worker count.
+        int count = scaling ? 1 : workers;
+        while(1)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            render_distributed(input_file, state, count, worker_ms);
+            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+            distributed_ms.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+            worker_counts.push_back(count);
+            if(count==workers) break;
+            count = std::min(2*count, workers);
+        }
+    }
+    else parse(input_file, state);
 
     FILE* stats_file = stdout;
     if(statistics_file) stats_file = fopen(statistics_file, "w");
 
     // Compare computed solution to solution file, if provided
     if(solution_file)
-        compare(state, stats_file, solution_file);
+        compare(state, stats_file, solution_file, diff_threshold, threads);
+
+    if(frames)
+    {
+        fprintf(stats_file, "frames: %d\n", frames);
+        fprintf(stats_file, "frame time: %.3f ms\n", frame_ms);
+    }
+
+    if(scaling)
+    {
+        for(size_t i=0;i<distributed_ms.size();i++)
+            fprintf(stats_file, "workers: %d time: %.3f ms speedup: %.2f\n", worker_counts[i],
+                distributed_ms[i], distributed_ms[0]/distributed_ms[i]);
+    }
+    else if(workers)
+    {
+        fprintf(stats_file, "workers: %d\n", workers);
+        fprintf(stats_file, "render time: %.3f ms\n", distributed_ms[0]);
+        for(int k=0;k<workers;k++)
+            fprintf(stats_file, "worker %d: %.3f ms\n", k, worker_ms[k]);
+    }
+
+    // Report how much work the pipeline did
+    if(print_counters)
+        print_stats(state, stats_file);
 
     // Save the computed solution to file
-    dump_png(state.image_color,state.image_width,state.image_height,"output.png");
+    dump_image(state.image_color,state.image_width,state.image_height,"output",output);
+    dump_render_targets(state,output);
 
     if(stats_file != stdout) fclose(stats_file);
+
+    if(trace_file) trace_write(trace_file);
     return 0;
 }
@@ -0,0 +1,407 @@
+#include "meshopt.h"
+#include "trace.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+    // Clusters stop growing once their own ACMR comes within this factor of
+    // the ACMR of the stretch of the optimized order they were cut from.
+    const float CLUSTER_THRESHOLD = 1.05f;
+
+    // Resolution of the grid measure_overdraw renders to.
+    const int OVERDRAW_GRID = 256;
+
+    // A FIFO vertex cache.
+    struct fifo_cache
+    {
+        std::vector<int> entries;
+        int next = 0;
+
+        explicit fifo_cache(int size) : entries(size, -1) {}
+
+        void clear()
+        {
+            std::fill(entries.begin(), entries.end(), -1);
+            next = 0;
+        }
+
+        // Look up vertex v, inserting it on a miss.  Returns whether it missed.
+        bool miss(int v)
+        {
+            for(size_t k = 0; k < entries.size(); k++)
+                if(entries[k] == v) return false;
+            entries[next] = v;
+            next = (next + 1) % entries.size();
+            return true;
+        }
+    };
+
+    // Tipsify's choice of the next fanning vertex among the vertices of the
+    // triangles just emitted: the one that will still be in the cache after
+    // its remaining triangles are emitted, and of those the oldest.  Returns
+    // -1 if there is none.
+    int next_candidate(const std::vector<int>& candidates, const std::vector<int>& live,
+        const std::vector<int>& timestamp, int time, int cache_size)
+    {
+        int best = -1, best_priority = -1;
+        for(size_t k = 0; k < candidates.size(); k++)
+        {
+            int v = candidates[k];
+            if(!live[v]) continue;
+            int priority = 0;
+            if(time - timestamp[v] + 2 * live[v] <= cache_size) priority = time - timestamp[v];
+            if(priority > best_priority)
+            {
+                best_priority = priority;
+                best = v;
+            }
+        }
+        return best;
+    }
+
+    // When there is no candidate, continue from the most recently used vertex
+    // that still has triangles, or else from the next such vertex in index
+    // order.  Returns -1 when every triangle has been emitted.
+    int skip_dead_end(std::vector<int>& dead_end, const std::vector<int>& live, int& cursor, int num_vertices)
+    {
+        while(!dead_end.empty())
+        {
+            int v = dead_end.back();
+            dead_end.pop_back();
+            if(live[v]) return v;
+        }
+        for(; cursor < num_vertices; cursor++)
+            if(live[cursor]) return cursor++;
+        return -1;
+    }
+
+    // Split the stretches of triangles [hard[k], hard[k+1]) into smaller
+    // clusters.  A cluster ends as soon as its own ACMR, simulated with a cache
+    // that starts empty, falls to within CLUSTER_THRESHOLD of the stretch's.
+    void split_clusters(const int* indices, int num_triangles, int cache_size, const std::vector<int>& hard,
+        std::vector<int>& clusters)
+    {
+        fifo_cache cache(cache_size);
+        clusters.clear();
+        for(size_t k = 0; k < hard.size(); k++)
+        {
+            int begin = hard[k];
+            int end = k + 1 < hard.size() ? hard[k + 1] : num_triangles;
+            cache.clear();
+            int misses = 0;
+            for(int i = 3 * begin; i < 3 * end; i++) misses += cache.miss(indices[i]);
+            float threshold = CLUSTER_THRESHOLD * misses / (end - begin);
+
+            cache.clear();
+            clusters.push_back(begin);
+            int start = begin;
+            misses = 0;
+            for(int t = begin; t < end - 1; t++)
+            {
+                for(int j = 0; j < 3; j++) misses += cache.miss(indices[3 * t + j]);
+                if(misses <= threshold * (t + 1 - start))
+                {
+                    start = t + 1;
+                    clusters.push_back(start);
+                    cache.clear();
+                    misses = 0;
+                }
+            }
+        }
+    }
+
+    // Depth used to order a triangle: the nearest z/w of its vertices in
+    // front of the eye, or infinity if none is.
+    float triangle_depth(const int* triangle, const vec4* positions)
+    {
+        float depth = std::numeric_limits<float>::infinity();
+        for(int j = 0; j < 3; j++)
+        {
+            const vec4& p = positions[triangle[j]];
+            if(p[3] > 0) depth = std::min(depth, p[2] / p[3]);
+        }
+        return depth;
+    }
+}
+
+long cache_misses(const int* indices, int num_triangles, int cache_size)
+{
+    fifo_cache cache(cache_size);
+    long misses = 0;
+    for(int i = 0; i < 3 * num_triangles; i++) misses += cache.miss(indices[i]);
+    return misses;
+}
+
+// Tipsify: emit all remaining triangles around one vertex at a time, moving
+// on to a vertex of the triangles just emitted that is likely to still be in
+// the cache.  Each jump to a vertex elsewhere starts a new stretch, which
+// split_clusters then divides further.
+void optimize_vertex_cache(int* indices, int num_triangles, int num_vertices, int cache_size,
+    std::vector<int>& clusters)
+{
+    TRACE_SCOPE("optimize_vertex_cache", "triangles", num_triangles);
+
+    // Triangles around each vertex: those of vertex v are
+    // adjacent[first[v]..first[v+1]).
+    std::vector<int> live(num_vertices, 0), first(num_vertices + 1, 0);
+    for(int i = 0; i < 3 * num_triangles; i++) live[indices[i]]++;
+    for(int v = 0; v < num_vertices; v++) first[v + 1] = first[v] + live[v];
+    std::vector<int> adjacent(3 * num_triangles), fill(first.begin(), first.end() - 1);
+    for(int i = 0; i < 3 * num_triangles; i++) adjacent[fill[indices[i]]++] = i / 3;
+
+    std::vector<int> result, hard, candidates, dead_end;
+    std::vector<int> timestamp(num_vertices, 0);
+    std::vector<bool> emitted(num_triangles, false);
+    result.reserve(3 * num_triangles);
+    int time = cache_size + 1, cursor = 0;
+    int fan = skip_dead_end(dead_end, live, cursor, num_vertices);
+    while(fan >= 0)
+    {
+        hard.push_back(result.size() / 3);
+        while(fan >= 0)
+        {
+            candidates.clear();
+            for(int a = first[fan]; a < first[fan + 1]; a++)
+            {
+                int t = adjacent[a];
+                if(emitted[t]) continue;
+                emitted[t] = true;
+                for(int j = 0; j < 3; j++)
+                {
+                    int v = indices[3 * t + j];
+                    result.push_back(v);
+                    dead_end.push_back(v);
+                    candidates.push_back(v);
+                    live[v]--;
+                    if(time - timestamp[v] > cache_size) timestamp[v] = time++;
+                }
+            }
+            fan = next_candidate(candidates, live, timestamp, time, cache_size);
+        }
+        fan = skip_dead_end(dead_end, live, cursor, num_vertices);
+    }
+    std::copy(result.begin(), result.end(), indices);
+    split_clusters(indices, num_triangles, cache_size, hard, clusters);
+}
+
+// Clusters are ordered by the average depth of their triangles.  Unlike the
+// view-independent ordering of Sander et al., this uses the clip-space
+// positions of the draw being rendered, so it suits that view in particular.
+void optimize_overdraw(int* indices, int num_triangles, std::vector<int>& clusters, const vec4* positions,
+    std::vector<int>& order)
+{
+    TRACE_SCOPE("optimize_overdraw", "clusters", clusters.size());
+
+    int count = clusters.size();
+    std::vector<float> depth(count);
+    std::vector<int> sorted(count);
+    for(int c = 0; c < count; c++)
+    {
+        int end = c + 1 < count ? clusters[c + 1] : num_triangles;
+        float sum = 0;
+        int visible = 0;
+        for(int t = clusters[c]; t < end; t++)
+        {
+            float d = triangle_depth(indices + 3 * t, positions);
+            if(d == std::numeric_limits<float>::infinity()) continue;
+            sum += d;
+            visible++;
+        }
+        depth[c] = visible ? sum / visible : std::numeric_limits<float>::infinity();
+        sorted[c] = c;
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [&depth](int a, int b) { return depth[a] < depth[b]; });
+
+    std::vector<int> new_clusters, old(indices, indices + 3 * num_triangles);
+    order.clear();
+    for(int k = 0; k < count; k++)
+    {
+        int c = sorted[k];
+        int end = c + 1 < count ? clusters[c + 1] : num_triangles;
+        new_clusters.push_back(order.size());
+        for(int t = clusters[c]; t < end; t++)
+        {
+            std::copy(&old[3 * t], &old[3 * t] + 3, indices + 3 * order.size());
+            order.push_back(t);
+        }
+    }
+    clusters.swap(new_clusters);
+}
+
+namespace
+{
+    inline vec3 vertex_position(const float* vertex_data, int floats_per_vertex, int v)
+    {
+        const float* p = vertex_data + v * floats_per_vertex;
+        return vec3(p[0], p[1], p[2]);
+    }
+
+    // Compute the bounding sphere and normal cone of a meshlet from its
+    // triangles.
+    void meshlet_bounds(meshlet& m, const int* indices, const float* vertex_data, int floats_per_vertex)
+    {
+        const int* triangles = indices + 3 * m.first_triangle;
+        vec3 low = vertex_position(vertex_data, floats_per_vertex, triangles[0]), high = low;
+        for(int i = 1; i < 3 * m.num_triangles; i++)
+        {
+            vec3 p = vertex_position(vertex_data, floats_per_vertex, triangles[i]);
+            for(int k = 0; k < 3; k++)
+            {
+                low[k] = std::min(low[k], p[k]);
+                high[k] = std::max(high[k], p[k]);
+            }
+        }
+        m.center = 0.5f * (low + high);
+        m.radius = 0;
+        for(int i = 0; i < 3 * m.num_triangles; i++)
+        {
+            vec3 p = vertex_position(vertex_data, floats_per_vertex, triangles[i]);
+            m.radius = std::max(m.radius, (p - m.center).magnitude());
+        }
+
+        // The axis is the average direction of the normals; triangles without
+        // area have no facing and are left out.
+        std::vector<vec3> normals;
+        vec3 sum;
+        for(int t = 0; t < m.num_triangles; t++)
+        {
+            vec3 a = vertex_position(vertex_data, floats_per_vertex, triangles[3 * t]);
+            vec3 b = vertex_position(vertex_data, floats_per_vertex, triangles[3 * t + 1]);
+            vec3 c = vertex_position(vertex_data, floats_per_vertex, triangles[3 * t + 2]);
+            vec3 n = cross(b - a, c - a);
+            float length = n.magnitude();
+            if(!(length > 0)) continue;
+            normals.push_back(n / length);
+            sum += normals.back();
+        }
+        m.cone_valid = false;
+        m.cone_sin = 1;
+        float length = sum.magnitude();
+        if(!(length > 0)) return;
+        m.cone_axis = sum / length;
+        float min_cos = 1;
+        for(size_t k = 0; k < normals.size(); k++) min_cos = std::min(min_cos, dot(normals[k], m.cone_axis));
+        if(min_cos <= 0) return;
+        m.cone_sin = std::sqrt(std::max(0.f, 1 - min_cos * min_cos));
+        m.cone_valid = true;
+    }
+}
+
+void build_meshlets(int* indices, int num_triangles, int num_vertices, const float* vertex_data,
+    int floats_per_vertex, std::vector<meshlet>& meshlets)
+{
+    TRACE_SCOPE("build_meshlets", "triangles", num_triangles);
+
+    std::vector<int> live(num_vertices, 0), first(num_vertices + 1, 0);
+    for(int i = 0; i < 3 * num_triangles; i++) live[indices[i]]++;
+    for(int v = 0; v < num_vertices; v++) first[v + 1] = first[v] + live[v];
+    std::vector<int> adjacent(3 * num_triangles), fill(first.begin(), first.end() - 1);
+    for(int i = 0; i < 3 * num_triangles; i++) adjacent[fill[indices[i]]++] = i / 3;
+
+    // in_meshlet[v] is the number of the meshlet that last used vertex v.
+    std::vector<int> in_meshlet(num_vertices, -1), result, candidates;
+    std::vector<bool> assigned(num_triangles, false);
+    result.reserve(3 * num_triangles);
+    meshlets.clear();
+    int seed = 0;
+    while(true)
+    {
+        while(seed < num_triangles && assigned[seed]) seed++;
+        if(seed == num_triangles) break;
+
+        int id = meshlets.size();
+        meshlets.push_back(meshlet());
+        meshlet& m = meshlets.back();
+        m.first_triangle = result.size() / 3;
+        int vertices = 0;
+        candidates.assign(1, seed);
+        while(m.num_triangles < MESHLET_MAX_TRIANGLES)
+        {
+            // Pick the candidate adding the fewest new vertices, and drop
+            // those already taken.
+            int best = -1, best_new = 4;
+            size_t kept = 0;
+            for(size_t k = 0; k < candidates.size(); k++)
+            {
+                int t = candidates[k];
+                if(assigned[t]) continue;
+                candidates[kept++] = t;
+                int added = 0;
+                for(int j = 0; j < 3; j++) added += in_meshlet[indices[3 * t + j]] != id;
+                if(added < best_new)
+                {
+                    best_new = added;
+                    best = t;
+                }
+            }
+            candidates.resize(kept);
+            if(best < 0 || vertices + best_new > MESHLET_MAX_VERTICES) break;
+
+            assigned[best] = true;
+            m.num_triangles++;
+            vertices += best_new;
+            for(int j = 0; j < 3; j++)
+            {
+                int v = indices[3 * best + j];
+                result.push_back(v);
+                if(in_meshlet[v] == id) continue;
+                in_meshlet[v] = id;
+                for(int a = first[v]; a < first[v + 1]; a++)
+                    if(!assigned[adjacent[a]]) candidates.push_back(adjacent[a]);
+            }
+        }
+    }
+    std::copy(result.begin(), result.end(), indices);
+    for(size_t k = 0; k < meshlets.size(); k++)
+        meshlet_bounds(meshlets[k], indices, vertex_data, floats_per_vertex);
+}
+
+void measure_overdraw(const int* indices, int num_triangles, const vec4* positions, long& fragments,
+    long& pixels)
+{
+    TRACE_SCOPE("measure_overdraw", "triangles", num_triangles);
+
+    const int size = OVERDRAW_GRID;
+    const float infinity = std::numeric_limits<float>::infinity();
+    std::vector<float> depth(size * size, infinity);
+    fragments = 0;
+    for(int t = 0; t < num_triangles; t++)
+    {
+        float x[3], y[3], z[3];
+        bool visible = true;
+        for(int j = 0; j < 3; j++)
+        {
+            const vec4& p = positions[indices[3 * t + j]];
+            if(p[3] <= 0) visible = false;
+            x[j] = (p[0] / p[3] + 1) * size / 2;
+            y[j] = (p[1] / p[3] + 1) * size / 2;
+            z[j] = p[2] / p[3];
+        }
+        if(!visible) continue;
+        float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if(area == 0) continue;
+
+        int x0 = std::max(0, (int)std::min(std::min(x[0], x[1]), x[2]));
+        int x1 = std::min(size - 1, (int)std::max(std::max(x[0], x[1]), x[2]));
+        int y0 = std::max(0, (int)std::min(std::min(y[0], y[1]), y[2]));
+        int y1 = std::min(size - 1, (int)std::max(std::max(y[0], y[1]), y[2]));
+        for(int j = y0; j <= y1; j++)
+        {
+            for(int i = x0; i <= x1; i++)
+            {
+                float px = i + 0.5f, py = j + 0.5f;
+                float a = ((x[1] - px) * (y[2] - py) - (x[2] - px) * (y[1] - py)) / area;
+                float b = ((x[2] - px) * (y[0] - py) - (x[0] - px) * (y[2] - py)) / area;
+                float c = 1 - a - b;
+                if(a < 0 || b < 0 || c < 0) continue;
+                float d = a * z[0] + b * z[1] + c * z[2];
+                if(d < -1 || d > 1 || d >= depth[j * size + i]) continue;
+                depth[j * size + i] = d;
+                fragments++;
+            }
+        }
+    }
+    pixels = size * size - std::count(depth.begin(), depth.end(), infinity);
+}
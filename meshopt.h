@@ -0,0 +1,71 @@
+#ifndef __MESHOPT__
+#define __MESHOPT__
+
+#include "common.h"
+#include <vector>
+
+// Mesh optimization for indexed triangle lists: reordering the triangles so
+// that the post-transform vertex cache is reused (Tipsify, Sander et al. 2007),
+// then ordering clusters of them front to back so that the depth test rejects
+// more fragments.  Indices are three ints per triangle, as in index_data.
+
+// Number of entries in the post-transform vertex cache that indexed draws
+// shade through.  It is a FIFO, as on most GPUs.
+static const int VERTEX_CACHE_SIZE = 32;
+
+// Number of vertex cache misses (vertex shader invocations) when drawing the
+// triangles in order through a FIFO cache of cache_size entries.  Divided by
+// num_triangles this is the average cache miss ratio (ACMR), which ranges from
+// 3 down to about 0.5 for large, well-ordered meshes.
+long cache_misses(const int* indices, int num_triangles, int cache_size);
+
+// Reorder the triangles in place for a vertex cache of cache_size entries.
+// The new order is split into clusters of triangles that are each fairly
+// efficient on their own, so that they can be reordered later without undoing
+// much of the optimization; clusters receives the first triangle of each.
+void optimize_vertex_cache(int* indices, int num_triangles, int num_vertices, int cache_size,
+    std::vector<int>& clusters);
+
+// Reorder the clusters found by optimize_vertex_cache in place so that those
+// nearest the eye are drawn first, keeping the order of triangles within each
+// cluster.  positions holds the clip-space position of each vertex.  clusters
+// is updated to match the new order, and order receives, for each triangle in
+// the new order, its position in the old one.
+void optimize_overdraw(int* indices, int num_triangles, std::vector<int>& clusters, const vec4* positions,
+    std::vector<int>& order);
+
+// Limits on the size of a meshlet, chosen as on mesh-shading GPUs.
+static const int MESHLET_MAX_VERTICES = 64;
+static const int MESHLET_MAX_TRIANGLES = 126;
+
+// A small cluster of triangles with bounds for culling it as a whole.  All of
+// the triangles lie in the sphere at center with the given radius, and every
+// triangle's unit normal (the direction of (b-a)x(c-a) for vertices a, b and
+// c) is within the angle whose sine is cone_sin of cone_axis.  cone_valid is
+// false when the normals spread over a hemisphere or more.
+struct meshlet
+{
+    int first_triangle = 0;
+    int num_triangles = 0;
+    vec3 center;
+    float radius = 0;
+    vec3 cone_axis;
+    float cone_sin = 1;
+    bool cone_valid = false;
+};
+
+// Split an indexed mesh into meshlets, reordering the triangles in place so
+// that each meshlet's are consecutive.  Meshlets are grown from a seed
+// triangle through its neighbors, preferring those that add the fewest new
+// vertices.  Positions are the first three floats of each vertex.
+void build_meshlets(int* indices, int num_triangles, int num_vertices, const float* vertex_data,
+    int floats_per_vertex, std::vector<meshlet>& meshlets);
+
+// Estimate overdraw by rendering depth only on a coarse grid.  fragments is
+// the number of samples that passed the depth test and pixels the number
+// covered at the end, so fragments/pixels is 1 for no overdraw at all.
+// Triangles that cross the w = 0 plane are skipped.
+void measure_overdraw(const int* indices, int num_triangles, const vec4* positions, long& fragments,
+    long& pixels);
+
+#endif
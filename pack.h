@@ -0,0 +1,107 @@
+#ifndef __PACK__
+#define __PACK__
+
+#include "common.h"
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+// Conversions from the floating-point colors produced by fragment shaders to
+// the formats stored in render targets.  These run once per fragment, so they
+// are inline and handle the four channels of a vec4 together where the
+// instruction set allows it.
+
+// Convert a color with channels in [0,1] to a pixel.  Channels are scaled by
+// 255 and truncated as make_pixel's callers always did, but out-of-range values
+// saturate to 0 or 255 rather than wrapping.  Alpha is set to 255.
+inline pixel pack_rgba8(const vec4& color)
+{
+#ifdef __SSE2__
+    // Reverse the channels so that the packed bytes read 0xRRGGBBAA.
+    __m128 c = _mm_loadu_ps(&color[0]);
+    c = _mm_mul_ps(_mm_shuffle_ps(c, c, _MM_SHUFFLE(0, 1, 2, 3)), _mm_set1_ps(255));
+    // Clamp before converting: cvttps turns infinity and values too large for
+    // an int into INT_MIN, which would pack to 0.  maxps returns its second
+    // operand for a NaN, so NaN channels become 0 as in the scalar code.
+    c = _mm_min_ps(_mm_max_ps(c, _mm_setzero_ps()), _mm_set1_ps(255));
+    __m128i i = _mm_cvttps_epi32(c);
+    i = _mm_packs_epi32(i, i);
+    i = _mm_packus_epi16(i, i);
+    return (pixel)_mm_cvtsi128_si32(i) | 0xff;
+#else
+    int rgb[3];
+    for(int k = 0; k < 3; k++)
+    {
+        float v = color[k] * 255;
+        rgb[k] = v > 0 ? (v < 255 ? (int)v : 255) : 0;
+    }
+    return make_pixel(rgb[0], rgb[1], rgb[2]);
+#endif
+}
+
+// Convert one float to IEEE half precision, rounding to nearest even.  Values
+// too large for a half become infinity; NaNs stay NaNs.
+inline unsigned short float_to_half(float f)
+{
+    unsigned int x;
+    memcpy(&x, &f, sizeof(x));
+    unsigned int sign = (x >> 16) & 0x8000;
+    x &= 0x7fffffff;
+    if(x > 0x7f800000) return sign | 0x7e00;
+    if(x >= 0x47800000) return sign | 0x7c00;
+    if(x < 0x38800000)
+    {
+        // Subnormal halves count in units of 2^-24.
+        if(x < 0x33000000) return sign;
+        unsigned int e = x >> 23;
+        unsigned int mantissa = (x & 0x7fffff) | 0x800000;
+        unsigned int shift = 126 - e;
+        unsigned int h = mantissa >> shift;
+        unsigned int rest = mantissa & ((1u << shift) - 1);
+        unsigned int halfway = 1u << (shift - 1);
+        if(rest > halfway || (rest == halfway && (h & 1))) h++;
+        return sign | h;
+    }
+    // Rebias the exponent from 127 to 15; a carry out of the mantissa moves
+    // into the exponent, and up to infinity for values just below 2^16.
+    unsigned int h = (x - 0x38000000) >> 13;
+    unsigned int rest = x & 0x1fff;
+    if(rest > 0x1000 || (rest == 0x1000 && (h & 1))) h++;
+    return sign | h;
+}
+
+// Convert an IEEE half back to a float.  This is exact.
+inline float half_to_float(unsigned short h)
+{
+    unsigned int sign = (h & 0x8000) << 16;
+    unsigned int e = (h >> 10) & 0x1f;
+    unsigned int mantissa = h & 0x3ff;
+    unsigned int x;
+    if(e == 0)
+    {
+        float f = mantissa * (1.0f / (1 << 24));
+        return sign ? -f : f;
+    }
+    if(e == 31) x = sign | 0x7f800000 | (mantissa << 13);
+    else x = sign | ((e + 112) << 23) | (mantissa << 13);
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// Convert the four channels of a color to halves, stored in out[0..3].
+inline void pack_rgba16f(const vec4& color, unsigned short out[4])
+{
+#ifdef __F16C__
+    __m128i h = _mm_cvtps_ph(_mm_loadu_ps(&color[0]), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storel_epi64((__m128i*)out, h);
+#else
+    for(int k = 0; k < 4; k++) out[k] = float_to_half(color[k]);
+#endif
+}
+
+#endif
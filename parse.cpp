@@ -1,48 +1,68 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <functional>
 #include <sstream>
+#include <thread>
 #include <vector>
+#include "command.h"
 #include "driver_state.h"
+#include "dump_png.h"
 #include "shaders.h"
+#include "trace.h"
 
-// Parse the input file and issue commands
-void parse(const char* test_file, driver_state& state)
-{
-    // Open file, make sure this succeeded
-    FILE* F = fopen(test_file,"r");
-    if(!F)
-    {
-        printf("Failed to open file '%s'\n",test_file);
-        exit(EXIT_FAILURE);
-    }
+// Number of commands the parsing thread may get ahead of rendering.
+static const size_t PARSE_QUEUE_SIZE = 16;
 
-    // Initialize the maps that allow us to access shaders by name.
-    register_named_shaders();
+// Parse a scene file into commands, passing each to emit as soon as it is
+// complete.  Draw packets come from queue, so that their memory is recycled,
+// or are allocated if queue is null.  Files named in the scene are relative
+// to directory.
+static void parse_commands(FILE* F, const std::string& directory, command_queue* queue,
+    const std::function<void(command&)>& emit)
+{
+    TRACE_SCOPE("parse_commands");
 
     // scratch space for parsing
     char buff[1000];
     ivec3 e;
 
-    // Local copies of the data that will eventually be stored in the driver for
-    // rending.  data => driver.vertex_data, indices => driver.index_data,
-    // uniform => driver.uniform_data.  Note that the driver only stores
-    // pointers into these std::vector's.  This is normally a very bad idea,
-    // since those pointers may change if the std::vectors are modified.  We
-    // must be careful to set the driver pointers only immediately before
-    // issuing the rendering commands.  Since the renders occur within this
-    // function, this data will not be used after these have gone out of scope.
+    auto new_packet=[queue]()
+    {
+        if(!queue) return std::make_shared<draw_packet>();
+        std::shared_ptr<draw_packet> packet=queue->new_packet();
+        draw_packet& p=*packet;
+        p.vertex_data.clear();
+        p.packed_data.clear();
+        p.index_data.clear();
+        p.uniform.clear();
+        p.instance_uniform.clear();
+        p.instance_uniform_size=0;
+        p.instances=0;
+        p.query.clear();
+        return packet;
+    };
+
+    // The data accumulated for the next render goes straight into its packet;
+    // the vertex layout, uniforms and shaders are copied into each packet when
+    // it is emitted, since they carry over to later renders.
     int floats_per_vertex=0;
-    std::vector<float> data;
-    std::vector<ivec3> indices;
+    interp_type interp_rules[MAX_FLOATS_PER_VERTEX]={};
+    vertex_layout layout;
+    shader_v vertex_shader=0;
+    shader_f fragment_shader=0;
+    std::shared_ptr<draw_packet> packet=new_packet();
     std::vector<float> uniform;
+    std::vector<float> instance_uniform;
+    int instance_uniform_size=0;
 
     // Parse the input, line by line
     while(fgets(buff, sizeof(buff), F))
     {
         std::stringstream ss(buff);
         std::string item,name;
+        command c;
 
         // If we did not get a line, the line is empty, or the line is a
         // comment, then move on.
@@ -51,13 +71,12 @@ void parse(const char* test_file, driver_state& state)
         {
             // format: size <w> <h>
             // Set image size.
-            int w,h;
-            ss>>w>>h;
-            initialize_render(state, w, h);
+            c.type=command_type::size;
+            ss>>c.width>>c.height;
         }
         else if(item=="vertex_data")
         {
-            // format: vertex_data <flags>
+            // format: vertex_data <flags> [<storage> ...]
             // The flags consists of a string of the characters f, n, or s.
 
             // There are floats_per_vertex characters in the string.  The
@@ -67,16 +86,25 @@ void parse(const char* test_file, driver_state& state)
             // n: non-perspective-correct interpolation
             // s: smooth; perspective-correct interpolation
             // The length of the string is used to deduce floats_per_vertex.
+            // The storage formats, if given, say how the floats are kept in
+            // memory until they are fetched for the vertex shader, in order,
+            // as in "float16x3 unorm8x3"; see vertex_format.h.  Without them
+            // every float is stored as a float32.
             ss>>buff;
             int i;
             for(i=0;buff[i];i++)
             {
-                if(buff[i]=='s') state.interp_rules[i]=interp_type::smooth;
-                else if(buff[i]=='n') state.interp_rules[i]=interp_type::noperspective;
-                else if(buff[i]=='f') state.interp_rules[i]=interp_type::flat;
+                if(buff[i]=='s') interp_rules[i]=interp_type::smooth;
+                else if(buff[i]=='n') interp_rules[i]=interp_type::noperspective;
+                else if(buff[i]=='f') interp_rules[i]=interp_type::flat;
                 else assert("invalid interpolation type" && 0);
             }
             floats_per_vertex=i;
+            layout=vertex_layout();
+            while(ss>>name)
+                if(!add_attribute(layout,name)) assert("invalid vertex storage format" && 0);
+            assert(!layout.num_attributes || layout.floats==floats_per_vertex);
+            continue;
         }
         else if(item=="v")
         {
@@ -84,22 +112,39 @@ void parse(const char* test_file, driver_state& state)
             // Provides the per-vertex data for one vertex
             // There should be floats_per_vertex floats on the line.
             float x;
+            if(layout.packed())
+            {
+                float vertex[MAX_FLOATS_PER_VERTEX];
+                for(int i=0;i<floats_per_vertex;i++)
+                {
+                    if(ss>>x) vertex[i]=x;
+                    else vertex[i]=0;
+                }
+                std::vector<unsigned char>& packed=packet->packed_data;
+                packed.resize(packed.size()+layout.stride);
+                encode_vertex(layout,vertex,&packed[packed.size()-layout.stride]);
+                continue;
+            }
             for(int i=0;i<floats_per_vertex;i++)
             {
-                if(ss>>x) data.push_back(x);
-                else data.push_back(0);
+                if(ss>>x) packet->vertex_data.push_back(x);
+                else packet->vertex_data.push_back(0);
             }
+            continue;
         }
         else if(item=="f")
         {
             // format: f <index> <index> <index>
             // Provides the indices of the vertices for one triangle.
             ss>>e;
-            indices.push_back(e);
+            packet->index_data.insert(packet->index_data.end(),&e[0],&e[0]+3);
+            continue;
         }
-        else if(item=="render")
+        else if(item=="render" || item=="render_instanced" || item=="render_if")
         {
             // format: render <type>
+            //         render_instanced <type> <count>
+            //         render_if <query> <type>
             // Render the information that has been accumulated, and then clear
             // out the state for the next render.  The accumulated data is to be
             // interpreted according to <type>, which may be:
@@ -108,24 +153,99 @@ void parse(const char* test_file, driver_state& state)
             //            to a triangle.  These numbers are indices into vertex_data.
             // fan -      The vertices are to be interpreted as a triangle fan.
             // strip -    The vertices are to be interpreted as a triangle strip.
-            // Assign pointers in driver immediately before doing the render to
-            // avoid memory errors.
+            // render_instanced renders the same data <count> times.  Each instance uses the
+            // matching instance_uniform block as its uniform data, if any
+            // were given, and the instance number is available to the vertex
+            // shader as gl_InstanceID.  The per-instance uniforms are cleared
+            // along with the vertex data.
+            // render_if renders like render, unless the occlusion query
+            // <query> has finished with no samples passing the depth test; in
+            // that case the data is cleared without being rendered.
+            draw_packet& p=*packet;
+            if(item=="render_if") ss>>p.query;
             ss>>name;
-            state.vertex_data=&data[0];
-            state.num_vertices=data.size()/floats_per_vertex;
-            state.floats_per_vertex=floats_per_vertex;
-            state.index_data=indices.size()?&indices[0][0]:0;
-            state.num_triangles=indices.size();
-            state.uniform_data=uniform.size()?&uniform[0]:0;
-            render_type t;
-            if(name=="indexed") t=render_type::indexed;
-            else if(name=="fan") t=render_type::fan;
-            else if(name=="triangle") t=render_type::triangle;
-            else if(name=="strip") t=render_type::strip;
+            if(name=="indexed") p.type=render_type::indexed;
+            else if(name=="fan") p.type=render_type::fan;
+            else if(name=="triangle") p.type=render_type::triangle;
+            else if(name=="strip") p.type=render_type::strip;
             else assert("invalid render type" && 0);
-            render(state,t);
-            data.clear();
-            indices.clear();
+            if(item=="render_instanced")
+            {
+                ss>>p.instances;
+                assert(p.instances>=0);
+                assert(!instance_uniform_size || (int)instance_uniform.size()>=p.instances*instance_uniform_size);
+                p.instance_uniform.swap(instance_uniform);
+                p.instance_uniform_size=instance_uniform_size;
+                instance_uniform.clear();
+                instance_uniform_size=0;
+                // A render of zero instances draws nothing, but still clears
+                // the accumulated data.
+                if(!p.instances)
+                {
+                    packet=new_packet();
+                    continue;
+                }
+            }
+            p.floats_per_vertex=floats_per_vertex;
+            p.layout=layout;
+            std::copy(interp_rules,interp_rules+MAX_FLOATS_PER_VERTEX,p.interp_rules);
+            p.uniform.assign(uniform.begin(),uniform.end());
+            p.vertex_shader=vertex_shader;
+            p.fragment_shader=fragment_shader;
+            c.type=command_type::draw;
+            c.packet=packet;
+            packet=new_packet();
+        }
+        else if(item=="buffer")
+        {
+            // format: buffer create <name>
+            //         buffer bind <name>
+            //         buffer unbind
+            //         buffer delete <name>
+            // create copies the vertices and indices accumulated so far, along
+            // with the current vertex_data layout, into a new buffer object
+            // (replacing any buffer of the same name), and clears them as a
+            // render would.  The data is copied rather than moved out of the
+            // command so that a recorded scene can be replayed.  While a
+            // buffer is bound, render and render_instanced draw its contents
+            // instead of accumulated data.  A buffer reuses the vertex shader
+            // results of its previous render when the shader and uniforms
+            // have not changed since.
+            std::string command_name;
+            ss>>command_name>>c.name;
+            if(command_name=="create")
+            {
+                assert(floats_per_vertex>0);
+                c.type=command_type::buffer_create;
+                packet->floats_per_vertex=floats_per_vertex;
+                packet->layout=layout;
+                std::copy(interp_rules,interp_rules+MAX_FLOATS_PER_VERTEX,packet->interp_rules);
+                c.packet=packet;
+                packet=new_packet();
+            }
+            else if(command_name=="bind") c.type=command_type::buffer_bind;
+            else if(command_name=="unbind") c.type=command_type::buffer_unbind;
+            else if(command_name=="delete") c.type=command_type::buffer_delete;
+            else assert("invalid buffer command" && 0);
+        }
+        else if(item=="query")
+        {
+            // format: query begin <name> [proxy]
+            //         query end
+            // Count the samples that pass the depth test during the renders
+            // between begin and end, for use by render_if.  With proxy, those
+            // renders only count samples and draw nothing, which suits
+            // bounding boxes standing in for expensive meshes.
+            ss>>name;
+            if(name=="begin")
+            {
+                std::string option;
+                ss>>c.name>>option;
+                c.type=command_type::query_begin;
+                c.enabled=option=="proxy";
+            }
+            else if(name=="end") c.type=command_type::query_end;
+            else assert("invalid query command" && 0);
         }
         else if(item=="uniform")
         {
@@ -134,22 +254,157 @@ void parse(const char* test_file, driver_state& state)
             uniform.clear();
             float x;
             while(ss>>x) uniform.push_back(x);
+            continue;
+        }
+        else if(item=="instance_uniform")
+        {
+            // format: instance_uniform <float> <float> <float> ...
+            // Provide the uniform data for the next instance of a
+            // render_instanced: the first line is used by instance 0, the
+            // second by instance 1, and so on.  Every line must have the same
+            // number of floats.
+            float x;
+            int size=0;
+            while(ss>>x)
+            {
+                instance_uniform.push_back(x);
+                size++;
+            }
+            assert(!instance_uniform_size || size==instance_uniform_size);
+            instance_uniform_size=size;
+            continue;
+        }
+        else if(item=="cull")
+        {
+            // format: cull <mode> [<front-face>]
+            // Discard triangles by facing before they are clipped.  <mode> is
+            // none (the default), back or front.  <front-face> gives the
+            // screen-space winding of front-facing triangles: ccw (the
+            // default) or cw.
+            c.type=command_type::cull;
+            ss>>name;
+            if(name=="none") c.cull_mode=cull_type::none;
+            else if(name=="back") c.cull_mode=cull_type::back;
+            else if(name=="front") c.cull_mode=cull_type::front;
+            else assert("invalid cull mode" && 0);
+            c.front_face=winding_type::ccw;
+            if(ss>>name)
+            {
+                if(name=="ccw") c.front_face=winding_type::ccw;
+                else if(name=="cw") c.front_face=winding_type::cw;
+                else assert("invalid front face" && 0);
+            }
+        }
+        else if(item=="blend")
+        {
+            // format: blend off
+            //         blend <src-factor> <dst-factor> [<equation>]
+            // Turn blending of fragments into the image off (the default) or
+            // on.  Factors are zero, one, src_color, one_minus_src_color,
+            // dst_color, one_minus_dst_color, src_alpha, one_minus_src_alpha,
+            // dst_alpha or one_minus_dst_alpha.  <equation> is add (the
+            // default), subtract, reverse_subtract, min or max.
+            c.type=command_type::blend;
+            ss>>name;
+            c.enabled=name!="off";
+            if(c.enabled)
+            {
+                std::string dst_name,op_name="add";
+                ss>>dst_name>>op_name;
+                auto factor=[](const std::string& n)
+                {
+                    static const char* names[]={"zero","one","src_color","one_minus_src_color","dst_color",
+                        "one_minus_dst_color","src_alpha","one_minus_src_alpha","dst_alpha","one_minus_dst_alpha"};
+                    for(int i=0;i<10;i++) if(n==names[i]) return (blend_factor)i;
+                    assert("invalid blend factor" && 0);
+                    return blend_factor::one;
+                };
+                c.blend_src=factor(name);
+                c.blend_dst=factor(dst_name);
+                if(op_name=="add") c.blend_op=blend_equation::add;
+                else if(op_name=="subtract") c.blend_op=blend_equation::subtract;
+                else if(op_name=="reverse_subtract") c.blend_op=blend_equation::reverse_subtract;
+                else if(op_name=="min") c.blend_op=blend_equation::min;
+                else if(op_name=="max") c.blend_op=blend_equation::max;
+                else assert("invalid blend equation" && 0);
+            }
+        }
+        else if(item=="texture")
+        {
+            // format: texture <unit> <png-file>
+            // Load an image and bind it to texture unit <unit>, from 0 to
+            // MAX_TEXTURE_UNITS-1, building its mip levels.  Fragment shaders
+            // sample it with texture().
+            c.type=command_type::texture;
+            c.unit=-1;
+            ss>>c.unit>>name;
+            assert(c.unit>=0 && c.unit<MAX_TEXTURE_UNITS);
+            if(name[0]!='/') name=directory+name;
+            pixel* image=0;
+            int w=0,h=0;
+            read_png(image,w,h,name.c_str());
+            texture_image* tex=new texture_image;
+            make_texture(*tex,image,w,h);
+            delete [] image;
+            c.texture.reset(tex);
+        }
+        else if(item=="sampler")
+        {
+            // format: sampler <unit> <filter> [<wrap>]
+            // Set how texture unit <unit> is sampled.  <filter> is nearest,
+            // bilinear (the default) or trilinear; <wrap> is repeat (the
+            // default) or clamp.
+            c.type=command_type::sampler;
+            c.unit=-1;
+            ss>>c.unit>>name;
+            assert(c.unit>=0 && c.unit<MAX_TEXTURE_UNITS);
+            if(name=="nearest") c.sampler.filter=texture_filter::nearest;
+            else if(name=="bilinear") c.sampler.filter=texture_filter::bilinear;
+            else if(name=="trilinear") c.sampler.filter=texture_filter::trilinear;
+            else assert("invalid texture filter" && 0);
+            c.sampler.wrap=texture_wrap::repeat;
+            if(ss>>name)
+            {
+                if(name=="repeat") c.sampler.wrap=texture_wrap::repeat;
+                else if(name=="clamp") c.sampler.wrap=texture_wrap::clamp;
+                else assert("invalid texture wrap" && 0);
+            }
+        }
+        else if(item=="target")
+        {
+            // format: target <index> <format>
+            // Enable render target <index>, from 1 to MAX_RENDER_TARGETS-1,
+            // which receives output_targets[<index>-1] from the fragment
+            // shader.  <format> is rgba8, rgba16f or r32f, or none to disable
+            // the target again.  The target takes the current image size.
+            c.type=command_type::target;
+            ss>>c.unit>>name;
+            assert(c.unit>=1 && c.unit<MAX_RENDER_TARGETS);
+            if(name=="none") c.format=target_format::none;
+            else if(name=="rgba8") c.format=target_format::rgba8;
+            else if(name=="rgba16f") c.format=target_format::rgba16f;
+            else if(name=="r32f") c.format=target_format::r32f;
+            else assert("invalid target format" && 0);
         }
         else if(item=="vertex_shader")
         {
             // format: vertex_shader <name>
             // Set the vertex shader
             ss>>name;
-            state.vertex_shader=vertex_shader_map[name];
-            assert(state.vertex_shader);
+            auto it=vertex_shader_map.find(name);
+            assert(it!=vertex_shader_map.end());
+            vertex_shader=it->second;
+            continue;
         }
         else if(item=="fragment_shader")
         {
             // format: fragment_shader <name>
             // Set the fragment shader
             ss>>name;
-            state.fragment_shader=fragment_shader_map[name];
-            assert(state.fragment_shader);
+            auto it=fragment_shader_map.find(name);
+            assert(it!=fragment_shader_map.end());
+            fragment_shader=it->second;
+            continue;
         }
         else
         {
@@ -159,6 +414,76 @@ void parse(const char* test_file, driver_state& state)
             printf("Unrecognized command: '%s'\n",buff);
             exit(EXIT_FAILURE);
         }
+        emit(c);
     }
+}
+
+// Open a scene file, exiting if it cannot be read.  Files named in the scene
+// are relative to the returned directory.
+static FILE* open_scene(const char* test_file, std::string& directory)
+{
+    // Open file, make sure this succeeded
+    FILE* F = fopen(test_file,"r");
+    if(!F)
+    {
+        printf("Failed to open file '%s'\n",test_file);
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize the maps that allow us to access shaders by name.
+    register_named_shaders();
+
+    // Files named in the scene are relative to the scene file's directory.
+    directory=test_file;
+    directory.erase(directory.find_last_of('/')+1);
+    return F;
+}
+
+// Parse the input file and issue commands.  With more than one thread
+// configured, parsing runs on its own thread, a bounded number of commands
+// ahead of the rendering done on this one, so that reading and tokenizing
+// the next draw overlaps rendering the current one.
+void parse(const char* test_file, driver_state& state)
+{
+    TRACE_SCOPE("parse");
+
+    std::string directory;
+    FILE* F = open_scene(test_file,directory);
+
+    // Start from the default pipeline settings, even if state was used before.
+    reset_pipeline_settings(state);
+
+    if(state.config.threads>1)
+    {
+        command_queue queue(PARSE_QUEUE_SIZE);
+        std::thread parser([&]()
+        {
+            parse_commands(F,directory,&queue,[&queue](command& c) { queue.push(c); });
+            queue.finish();
+        });
+        command c;
+        while(queue.pop(c))
+        {
+            execute_command(state,c);
+            queue.recycle(c.packet);
+            c=command();
+        }
+        parser.join();
+    }
+    else parse_commands(F,directory,0,[&state](command& c) { execute_command(state,c); });
+    fclose(F);
+
+    // Combine the samples of a multisampled render into the final image.
+    resolve_render(state);
+}
+
+void record_scene(const char* test_file, std::vector<command>& commands)
+{
+    TRACE_SCOPE("record_scene");
+
+    std::string directory;
+    FILE* F = open_scene(test_file,directory);
+    commands.clear();
+    parse_commands(F,directory,0,[&commands](command& c) { commands.push_back(c); });
     fclose(F);
 }
@@ -78,9 +78,42 @@ void fragment_shader_gouraud(const data_fragment& in, data_output& out,
     out.output_color = vec4(v.color,0);
 }
 
-// Assign shaders to the maps so they can be accessed by name.
+// Simple fragment shader: pass through interpolated per-vertex color and alpha.
+// Used with vertex_shader_color, which leaves the alpha in the vertex data.
+void fragment_shader_gouraud_alpha(const data_fragment& in, data_output& out,
+    const float * uniform_data)
+{
+    vertex_pca& v = *(vertex_pca*)in.data;
+    out.output_color = v.color;
+}
+
+// Fragment shader: sample texture unit 0 at the interpolated texture
+// coordinates.  Used with vertex_shader_transform, which leaves them in the
+// vertex data.
+void fragment_shader_texture(const data_fragment& in, data_output& out,
+    const float * uniform_data)
+{
+    out.output_color = texture(in,0,3);
+}
+
+// Fragment shader for multiple render targets: the interpolated per-vertex color
+// goes to the image and, unclamped, to target 2, and the interpolated vertex
+// position goes to target 1.
+void fragment_shader_targets(const data_fragment& in, data_output& out,
+    const float * uniform_data)
+{
+    vertex_pc& v = *(vertex_pc*)in.data;
+    out.output_color = vec4(v.color,0);
+    out.output_targets[0] = vec4(v.position,1);
+    out.output_targets[1] = vec4(v.color,1);
+}
+
+// Assign shaders to the maps so they can be accessed by name.  Calling this
+// again once the maps are filled does nothing, so renders running on other
+// threads only ever read the maps.
 void register_named_shaders()
 {
+    if(!vertex_shader_map.empty()) return;
     vertex_shader_map["trivial"]=vertex_shader_trivial;
     vertex_shader_map["transform"]=vertex_shader_transform;
     vertex_shader_map["color"]=vertex_shader_color;
@@ -90,4 +123,7 @@ void register_named_shaders()
     fragment_shader_map["white"]=fragment_shader_white;
     fragment_shader_map["gouraud"]=fragment_shader_gouraud;
     fragment_shader_map["uniform"]=fragment_shader_uniform;
+    fragment_shader_map["gouraud_alpha"]=fragment_shader_gouraud_alpha;
+    fragment_shader_map["targets"]=fragment_shader_targets;
+    fragment_shader_map["texture"]=fragment_shader_texture;
 }
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "mat.h"
+#include "texture.h"
 #include <map>
 
 // Vertex layout: each vertex stores only position, as a 3-vector
@@ -17,6 +18,20 @@ struct vertex_pc : public vertex_p
     vec3 color;
 };
 
+// Vertex layout: each vertex stores position (3-vector) followed by color with
+// alpha (4-vector)
+struct vertex_pca : public vertex_p
+{
+    vec4 color;
+};
+
+// Vertex layout: each vertex stores position (3-vector) followed by texture
+// coordinates (2-vector)
+struct vertex_pt : public vertex_p
+{
+    vec2 texcoord;
+};
+
 // Uniform data layout: just store transform matrix
 struct uniform_transform
 {
@@ -0,0 +1,142 @@
+#include "texture.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    // Position of texel (x, y) within a mip level's tiled storage.
+    inline int texel_index(const texture_level& level, int x, int y)
+    {
+        int tile = (y >> 2) * level.tiles_x + (x >> 2);
+        int morton = (x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2);
+        return (tile << 4) | morton;
+    }
+
+    // Copy an image with rows stored bottom-up into tiled storage.
+    void store_level(texture_level& level, const pixel* data, int width, int height)
+    {
+        level.width = width;
+        level.height = height;
+        level.tiles_x = (width + 3) / 4;
+        level.texels.assign(level.tiles_x * ((height + 3) / 4) * 16, 0);
+        for(int y = 0; y < height; y++)
+            for(int x = 0; x < width; x++)
+                level.texels[texel_index(level, x, y)] = data[y * width + x];
+    }
+
+    // Halve an image with a 2x2 box filter.  Odd rows and columns at the edge
+    // are averaged with themselves.
+    void downsample(const std::vector<pixel>& in, int width, int height, std::vector<pixel>& out,
+        int out_width, int out_height)
+    {
+        out.resize(out_width * out_height);
+        for(int y = 0; y < out_height; y++)
+        {
+            for(int x = 0; x < out_width; x++)
+            {
+                int x0 = 2 * x, x1 = std::min(2 * x + 1, width - 1);
+                int y0 = 2 * y, y1 = std::min(2 * y + 1, height - 1);
+                pixel p[4] = {in[y0 * width + x0], in[y0 * width + x1], in[y1 * width + x0], in[y1 * width + x1]};
+                pixel result = 0;
+                for(int shift = 0; shift < 32; shift += 8)
+                {
+                    unsigned int sum = 2;
+                    for(int k = 0; k < 4; k++) sum += (p[k] >> shift) & 0xff;
+                    result |= (sum / 4) << shift;
+                }
+                out[y * out_width + x] = result;
+            }
+        }
+    }
+
+    inline int wrap_coordinate(int x, int size, texture_wrap wrap)
+    {
+        if(wrap == texture_wrap::clamp) return std::min(std::max(x, 0), size - 1);
+        x %= size;
+        return x < 0 ? x + size : x;
+    }
+
+    inline vec4 fetch(const texture_level& level, int x, int y, texture_wrap wrap)
+    {
+        x = wrap_coordinate(x, level.width, wrap);
+        y = wrap_coordinate(y, level.height, wrap);
+        pixel p = level.texels[texel_index(level, x, y)];
+        const float scale = 1.0f / 255;
+        return vec4((p >> 24) * scale, ((p >> 16) & 0xff) * scale, ((p >> 8) & 0xff) * scale, (p & 0xff) * scale);
+    }
+
+    vec4 sample_nearest(const texture_level& level, const vec2& uv, texture_wrap wrap)
+    {
+        return fetch(level, (int)std::floor(uv[0] * level.width), (int)std::floor(uv[1] * level.height), wrap);
+    }
+
+    vec4 sample_bilinear(const texture_level& level, const vec2& uv, texture_wrap wrap)
+    {
+        float x = uv[0] * level.width - 0.5f, y = uv[1] * level.height - 0.5f;
+        float fx = std::floor(x), fy = std::floor(y);
+        int x0 = (int)fx, y0 = (int)fy;
+        float s = x - fx, t = y - fy;
+        vec4 bottom = (1 - s) * fetch(level, x0, y0, wrap) + s * fetch(level, x0 + 1, y0, wrap);
+        vec4 top = (1 - s) * fetch(level, x0, y0 + 1, wrap) + s * fetch(level, x0 + 1, y0 + 1, wrap);
+        return (1 - t) * bottom + t * top;
+    }
+}
+
+// Build the tiled mip chain for an image.
+void make_texture(texture_image& tex, const pixel* data, int width, int height)
+{
+    tex.levels.clear();
+    std::vector<pixel> image(data, data + width * height), smaller;
+    while(true)
+    {
+        tex.levels.push_back(texture_level());
+        store_level(tex.levels.back(), &image[0], width, height);
+        if(width == 1 && height == 1) break;
+        int next_width = std::max(width / 2, 1), next_height = std::max(height / 2, 1);
+        downsample(image, width, height, smaller, next_width, next_height);
+        image.swap(smaller);
+        width = next_width;
+        height = next_height;
+    }
+}
+
+// Sample a texture unit.  The level of detail is log2 of the larger of the
+// lengths of the two derivatives, measured in texels of the full image.
+vec4 sample_texture(const texture_unit& unit, const vec2& uv, const vec2& duv_dx, const vec2& duv_dy)
+{
+    if(!unit.image) return vec4(0, 0, 0, 1);
+    const std::vector<texture_level>& levels = unit.image->levels;
+    texture_wrap wrap = unit.sampler.wrap;
+
+    if(unit.sampler.filter == texture_filter::nearest)
+        return sample_nearest(levels[0], uv, wrap);
+
+    float w = levels[0].width, h = levels[0].height;
+    float length_x = std::sqrt(duv_dx[0] * duv_dx[0] * w * w + duv_dx[1] * duv_dx[1] * h * h);
+    float length_y = std::sqrt(duv_dy[0] * duv_dy[0] * w * w + duv_dy[1] * duv_dy[1] * h * h);
+    float rho = std::max(length_x, length_y);
+    float max_lod = levels.size() - 1;
+    float lod = rho > 1 ? std::min(std::log2(rho), max_lod) : 0;
+
+    if(unit.sampler.filter == texture_filter::bilinear)
+        return sample_bilinear(levels[(int)(lod + 0.5f)], uv, wrap);
+
+    int level = (int)lod;
+    float blend = lod - level;
+    vec4 color = sample_bilinear(levels[level], uv, wrap);
+    if(blend > 0) color = (1 - blend) * color + blend * sample_bilinear(levels[level + 1], uv, wrap);
+    return color;
+}
+
+// Sample a texture unit with the fragment's texture coordinates.
+vec4 texture(const data_fragment& in, int unit, int coord)
+{
+    vec2 uv(in.data[coord], in.data[coord + 1]);
+    vec2 duv_dx, duv_dy;
+    if(in.ddx)
+    {
+        duv_dx = vec2(in.ddx[coord], in.ddx[coord + 1]);
+        duv_dy = vec2(in.ddy[coord], in.ddy[coord + 1]);
+    }
+    return sample_texture(in.textures[unit], uv, duv_dx, duv_dy);
+}
@@ -0,0 +1,74 @@
+#ifndef __TEXTURE__
+#define __TEXTURE__
+
+#include "common.h"
+#include <memory>
+#include <vector>
+
+// Number of texture units a scene can bind textures to.
+static const int MAX_TEXTURE_UNITS = 4;
+
+// Texture filters.
+//   texture_filter::nearest   - the texel nearest to the sample point, from the
+//                               full-resolution image only.
+//   texture_filter::bilinear  - the four nearest texels blended, from the mip
+//                               level closest to the level of detail.
+//   texture_filter::trilinear - bilinear samples from the two mip levels around
+//                               the level of detail, blended.
+enum class texture_filter {nearest, bilinear, trilinear};
+
+// What happens to texture coordinates outside of [0,1].
+enum class texture_wrap {repeat, clamp};
+
+// How a texture unit samples its texture.
+struct sampler_state
+{
+    texture_filter filter = texture_filter::bilinear;
+    texture_wrap wrap = texture_wrap::repeat;
+};
+
+// One mip level.  Texels are grouped into 4x4 tiles of 16 texels (64 bytes,
+// one cache line); tiles are stored row by row, and the texels within a tile
+// in Morton (Z) order, so the texels used by one bilinear sample, and by
+// neighboring fragments, are almost always in the same cache line.  Widths
+// and heights that are not multiples of 4 are padded out to full tiles.
+struct texture_level
+{
+    int width = 0;
+    int height = 0;
+    int tiles_x = 0;
+    std::vector<pixel> texels;
+};
+
+// A texture with its full chain of mip levels, down to 1x1.  Texel (0,0) is
+// the bottom left of the image, so texture coordinate (0,0) is too.
+struct texture_image
+{
+    std::vector<texture_level> levels;
+};
+
+// A texture unit: the texture bound to it, if any, and its sampler settings.
+// The texture is shared, since it is never changed once built; a recorded
+// scene's texture commands bind the same image each time they are replayed.
+struct texture_unit
+{
+    std::shared_ptr<const texture_image> image;
+    sampler_state sampler;
+};
+
+// Build tex from an image whose rows are stored bottom-up (as read_png returns
+// them), computing the mip levels with a 2x2 box filter.
+void make_texture(texture_image& tex, const pixel* data, int width, int height);
+
+// Sample the texture bound to unit at texture coordinates uv.  duv_dx and
+// duv_dy are the screen-space derivatives of uv, from which the level of
+// detail is chosen.  Returns RGBA in [0,1]; an empty unit samples as opaque
+// black.
+vec4 sample_texture(const texture_unit& unit, const vec2& uv, const vec2& duv_dx, const vec2& duv_dy);
+
+// Sample texture unit "unit" from a fragment shader, like GLSL's texture().
+// The texture coordinates are the two floats starting at in.data[coord], and
+// their derivatives come from in.ddx and in.ddy.
+vec4 texture(const data_fragment& in, int unit, int coord);
+
+#endif
@@ -0,0 +1,117 @@
+#include "trace.h"
+#include <cstdio>
+
+#ifdef DRIVER_TRACE
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+
+namespace
+{
+    // One recorded complete event.  Times are kept in nanoseconds relative to
+    // the moment tracing was enabled.
+    struct trace_event
+    {
+        const char* name;
+        const char* arg_name;
+        long long arg;
+        long long begin;
+        long long duration;
+    };
+
+    // Events are buffered per thread so that recording never takes a lock;
+    // the lock is only taken once per thread, when its buffer is registered.
+    struct trace_buffer
+    {
+        int tid;
+        std::vector<trace_event> events;
+    };
+
+    bool enabled = false;
+    std::chrono::steady_clock::time_point epoch;
+    std::mutex buffers_mutex;
+    std::vector<std::unique_ptr<trace_buffer> > buffers;
+
+    trace_buffer& thread_buffer()
+    {
+        thread_local trace_buffer* buffer = 0;
+        if(!buffer)
+        {
+            std::lock_guard<std::mutex> lock(buffers_mutex);
+            buffers.emplace_back(new trace_buffer);
+            buffer = buffers.back().get();
+            buffer->tid = buffers.size();
+        }
+        return *buffer;
+    }
+
+    long long since_epoch(std::chrono::steady_clock::time_point t)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t-epoch).count();
+    }
+}
+
+trace_scope::trace_scope(const char* name, const char* arg_name, long long arg)
+    : name(name), arg_name(arg_name), arg(arg), active(enabled)
+{
+    if(active) start = std::chrono::steady_clock::now();
+}
+
+trace_scope::~trace_scope()
+{
+    if(!active) return;
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    trace_event e = {name, arg_name, arg, since_epoch(start), since_epoch(end)-since_epoch(start)};
+    thread_buffer().events.push_back(e);
+}
+
+bool trace_enable()
+{
+    epoch = std::chrono::steady_clock::now();
+    enabled = true;
+    return true;
+}
+
+void trace_write(const char* filename)
+{
+    FILE* F = fopen(filename, "w");
+    if(!F)
+    {
+        printf("Failed to open trace file '%s'\n", filename);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    int pid = getpid();
+    bool first = true;
+    fprintf(F, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for(size_t b = 0; b < buffers.size(); b++)
+    {
+        for(size_t i = 0; i < buffers[b]->events.size(); i++)
+        {
+            const trace_event& e = buffers[b]->events[i];
+            fprintf(F, "%s\n{\"name\":\"%s\",\"cat\":\"driver\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                first ? "" : ",", e.name, pid, buffers[b]->tid, e.begin/1000.0, e.duration/1000.0);
+            if(e.arg_name) fprintf(F, ",\"args\":{\"%s\":%lld}", e.arg_name, e.arg);
+            fprintf(F, "}");
+            first = false;
+        }
+    }
+    fprintf(F, "\n]}\n");
+    fclose(F);
+}
+
+#else
+
+bool trace_enable()
+{
+    return false;
+}
+
+void trace_write(const char*)
+{
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef __TRACE__
+#define __TRACE__
+
+// Scoped timers for the hot paths of the pipeline.  When the project is built
+// with DRIVER_TRACE defined (cmake -DDRIVER_TRACE=ON), each TRACE_SCOPE records
+// one complete event covering the lifetime of the enclosing scope.  The events
+// are written in the Chrome trace-event JSON format, which can be loaded in
+// chrome://tracing or ui.perfetto.dev.  Without DRIVER_TRACE the macro expands
+// to nothing, so the instrumented code pays nothing for it.
+//
+// Usage:
+//   TRACE_SCOPE("render");                      // just a name
+//   TRACE_SCOPE("clip_triangle", "triangles", n); // name plus one integer arg
+//
+// Names and argument names must be string literals (only the pointer is kept).
+
+#ifdef DRIVER_TRACE
+
+#include <chrono>
+
+class trace_scope
+{
+public:
+    trace_scope(const char* name, const char* arg_name = 0, long long arg = 0);
+    ~trace_scope();
+
+private:
+    const char* name;
+    const char* arg_name;
+    long long arg;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+};
+
+#define TRACE_CONCAT_INNER(a,b) a##b
+#define TRACE_CONCAT(a,b) TRACE_CONCAT_INNER(a,b)
+#define TRACE_SCOPE(...) trace_scope TRACE_CONCAT(trace_scope_,__LINE__)(__VA_ARGS__)
+
+#else
+
+#define TRACE_SCOPE(...) do {} while(0)
+
+#endif
+
+// Start recording events.  Returns false if tracing was compiled out, in which
+// case nothing will be recorded.
+bool trace_enable();
+
+// Write all events recorded so far to filename.  Safe to call only after all
+// threads that record events have finished.
+void trace_write(const char* filename);
+
+#endif
@@ -0,0 +1,279 @@
+#include "vertex_format.h"
+#include "pack.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    // Bytes taken by one float stored in a format.
+    int format_size(attrib_format format)
+    {
+        switch(format)
+        {
+            case attrib_format::float32: return 4;
+            case attrib_format::float16: return 2;
+            case attrib_format::unorm8: return 1;
+            case attrib_format::unorm16: return 2;
+            case attrib_format::snorm8: return 1;
+            case attrib_format::snorm16: return 2;
+        }
+        return 4;
+    }
+
+    // Round a float, already clamped to [low, high], to the nearest integer.
+    inline int quantize(float x, float low, float high, float scale)
+    {
+        x = x < low ? low : (x > high ? high : x);
+        return (int)std::lround(x * scale);
+    }
+
+    // Decode count floats of one attribute from each of n vertices.  in points
+    // at the attribute of the first vertex, and out at its first float.
+    template<class T, class F>
+    inline void decode_attribute(const unsigned char* in, int stride, int count, int n, float* out, int floats,
+        F convert)
+    {
+        for(int v = 0; v < n; v++, in += stride, out += floats)
+        {
+            T value[MAX_FLOATS_PER_VERTEX];
+            memcpy(value, in, count * sizeof(T));
+            for(int k = 0; k < count; k++) out[k] = convert(value[k]);
+        }
+    }
+
+#ifdef __SSE2__
+    // Like decode_attribute, but converting four values at a time with
+    // convert4, which loads them from a pointer.  It always reads and writes
+    // groups of four, so for a count that is not a multiple of four it runs
+    // past the attribute.  Vertices near the end, where that would run past
+    // the data or past out, are decoded with convert instead.  first is the
+    // index of the attribute's first float within a vertex.
+    template<class T, class F, class G>
+    inline void decode_attribute(const unsigned char* in, int stride, int offset, int count, int n, float* out,
+        int floats, int first, F convert, G convert4)
+    {
+        int rounded = (count + 3) & ~3;
+        int reach = offset + rounded * (int)sizeof(T);
+        int tail = std::max(reach > stride ? (reach - 1) / stride : 0,
+            first + rounded > floats ? (first + rounded - 1) / floats : 0);
+        int safe = std::max(0, n - tail);
+
+        // The extra floats written past the attribute are harmless when they
+        // land on attributes that are decoded later, since those overwrite
+        // them.  If any land on an earlier attribute of a following vertex,
+        // the last group is merged with what out already holds; keep selects
+        // the lanes of that group that belong to the attribute.
+        bool merge = false;
+        for(int p = first + count; p < first + rounded; p++)
+            if(p >= floats && p % floats < first) merge = true;
+        int last = count - (rounded - 4);
+        __m128 keep = _mm_castsi128_ps(_mm_cmplt_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(last)));
+        for(int v = 0; v < safe; v++, in += stride, out += floats)
+        {
+            int k = 0;
+            for(; k + 4 < rounded; k += 4) _mm_storeu_ps(out + k, convert4(in + k * sizeof(T)));
+            __m128 x = convert4(in + k * sizeof(T));
+            if(merge) x = _mm_or_ps(_mm_and_ps(keep, x), _mm_andnot_ps(keep, _mm_loadu_ps(out + k)));
+            _mm_storeu_ps(out + k, x);
+        }
+        decode_attribute<T>(in, stride, count, n - safe, out, floats, convert);
+    }
+
+    // Widen the low four 8- or 16-bit integers of x to 32 bits, with zeros or
+    // copies of the sign bit.
+    inline __m128i widen_u8(__m128i x)
+    {
+        return _mm_unpacklo_epi16(_mm_unpacklo_epi8(x, _mm_setzero_si128()), _mm_setzero_si128());
+    }
+    inline __m128i widen_s8(__m128i x)
+    {
+        x = _mm_unpacklo_epi8(x, x);
+        return _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 24);
+    }
+    inline __m128i widen_u16(__m128i x)
+    {
+        return _mm_unpacklo_epi16(x, _mm_setzero_si128());
+    }
+    inline __m128i widen_s16(__m128i x)
+    {
+        return _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    }
+
+    inline __m128i load4_8(const unsigned char* p)
+    {
+        int x;
+        memcpy(&x, p, sizeof(x));
+        return _mm_cvtsi32_si128(x);
+    }
+    inline __m128i load4_16(const unsigned char* p)
+    {
+        return _mm_loadl_epi64((const __m128i*)p);
+    }
+#endif
+}
+
+bool vertex_layout::packed() const
+{
+    for(int i = 0; i < num_attributes; i++)
+        if(attributes[i].format != attrib_format::float32) return true;
+    return false;
+}
+
+bool add_attribute(vertex_layout& layout, const std::string& name)
+{
+    static const char* names[] = {"float32", "float16", "unorm8", "unorm16", "snorm8", "snorm16"};
+    for(int f = 0; f < 6; f++)
+    {
+        size_t length = strlen(names[f]);
+        if(name.compare(0, length, names[f])) continue;
+
+        int count = 1;
+        if(name.size() > length)
+        {
+            if(name[length] != 'x' || name.size() == length + 1) return false;
+            char* end = 0;
+            count = strtol(name.c_str() + length + 1, &end, 10);
+            if(*end || count < 1) return false;
+        }
+        if(layout.floats + count > MAX_FLOATS_PER_VERTEX) return false;
+
+        vertex_layout::attribute& a = layout.attributes[layout.num_attributes++];
+        a.format = (attrib_format)f;
+        a.count = count;
+        a.offset = layout.stride;
+        layout.floats += count;
+        layout.stride += count * format_size(a.format);
+        return true;
+    }
+    return false;
+}
+
+void encode_vertex(const vertex_layout& layout, const float* in, unsigned char* out)
+{
+    for(int i = 0; i < layout.num_attributes; i++)
+    {
+        const vertex_layout::attribute& a = layout.attributes[i];
+        unsigned char* p = out + a.offset;
+        for(int k = 0; k < a.count; k++, in++)
+        {
+            switch(a.format)
+            {
+                case attrib_format::float32:
+                    memcpy(p + 4 * k, in, 4);
+                    break;
+                case attrib_format::float16:
+                {
+                    unsigned short h = float_to_half(*in);
+                    memcpy(p + 2 * k, &h, 2);
+                    break;
+                }
+                case attrib_format::unorm8:
+                    p[k] = quantize(*in, 0, 1, 255);
+                    break;
+                case attrib_format::unorm16:
+                {
+                    unsigned short u = quantize(*in, 0, 1, 65535);
+                    memcpy(p + 2 * k, &u, 2);
+                    break;
+                }
+                case attrib_format::snorm8:
+                    p[k] = (unsigned char)(signed char)quantize(*in, -1, 1, 127);
+                    break;
+                case attrib_format::snorm16:
+                {
+                    short s = quantize(*in, -1, 1, 32767);
+                    memcpy(p + 2 * k, &s, 2);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void decode_vertices(const vertex_layout& layout, const unsigned char* packed, int count, float* out)
+{
+    int stride = layout.stride, floats = layout.floats;
+    float* first = out;
+    for(int i = 0; i < layout.num_attributes; i++)
+    {
+        const vertex_layout::attribute& a = layout.attributes[i];
+        const unsigned char* in = packed + a.offset;
+        // The vector conversions compute the same single-precision products
+        // as the scalar ones, so the two give identical floats.
+        switch(a.format)
+        {
+            case attrib_format::float32:
+                decode_attribute<float>(in, stride, a.count, count, first, floats,
+                    [](float x) { return x; });
+                break;
+            case attrib_format::float16:
+#ifdef __F16C__
+                decode_attribute<unsigned short>(in, stride, a.offset, a.count, count, first, floats, (int)(first - out),
+                    [](unsigned short x) { return half_to_float(x); },
+                    [](const unsigned char* p) { return _mm_cvtph_ps(load4_16(p)); });
+#else
+                decode_attribute<unsigned short>(in, stride, a.count, count, first, floats,
+                    [](unsigned short x) { return half_to_float(x); });
+#endif
+                break;
+#ifdef __SSE2__
+            case attrib_format::unorm8:
+                decode_attribute<unsigned char>(in, stride, a.offset, a.count, count, first, floats, (int)(first - out),
+                    [](unsigned char x) { return x * (1.0f / 255); },
+                    [](const unsigned char* p)
+                    { return _mm_mul_ps(_mm_cvtepi32_ps(widen_u8(load4_8(p))), _mm_set1_ps(1.0f / 255)); });
+                break;
+            case attrib_format::unorm16:
+                decode_attribute<unsigned short>(in, stride, a.offset, a.count, count, first, floats, (int)(first - out),
+                    [](unsigned short x) { return x * (1.0f / 65535); },
+                    [](const unsigned char* p)
+                    { return _mm_mul_ps(_mm_cvtepi32_ps(widen_u16(load4_16(p))), _mm_set1_ps(1.0f / 65535)); });
+                break;
+            case attrib_format::snorm8:
+                decode_attribute<signed char>(in, stride, a.offset, a.count, count, first, floats, (int)(first - out),
+                    [](signed char x) { return std::max(x * (1.0f / 127), -1.0f); },
+                    [](const unsigned char* p)
+                    {
+                        __m128 x = _mm_mul_ps(_mm_cvtepi32_ps(widen_s8(load4_8(p))), _mm_set1_ps(1.0f / 127));
+                        return _mm_max_ps(x, _mm_set1_ps(-1));
+                    });
+                break;
+            case attrib_format::snorm16:
+                decode_attribute<short>(in, stride, a.offset, a.count, count, first, floats, (int)(first - out),
+                    [](short x) { return std::max(x * (1.0f / 32767), -1.0f); },
+                    [](const unsigned char* p)
+                    {
+                        __m128 x = _mm_mul_ps(_mm_cvtepi32_ps(widen_s16(load4_16(p))), _mm_set1_ps(1.0f / 32767));
+                        return _mm_max_ps(x, _mm_set1_ps(-1));
+                    });
+                break;
+#else
+            case attrib_format::unorm8:
+                decode_attribute<unsigned char>(in, stride, a.count, count, first, floats,
+                    [](unsigned char x) { return x * (1.0f / 255); });
+                break;
+            case attrib_format::unorm16:
+                decode_attribute<unsigned short>(in, stride, a.count, count, first, floats,
+                    [](unsigned short x) { return x * (1.0f / 65535); });
+                break;
+            case attrib_format::snorm8:
+                decode_attribute<signed char>(in, stride, a.count, count, first, floats,
+                    [](signed char x) { return std::max(x * (1.0f / 127), -1.0f); });
+                break;
+            case attrib_format::snorm16:
+                decode_attribute<short>(in, stride, a.count, count, first, floats,
+                    [](short x) { return std::max(x * (1.0f / 32767), -1.0f); });
+                break;
+#endif
+        }
+        first += a.count;
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef __VERTEX_FORMAT__
+#define __VERTEX_FORMAT__
+
+#include "common.h"
+#include <string>
+
+// Compact storage for vertex data.  A vertex is normally floats_per_vertex
+// 32-bit floats, but its floats can instead be stored in smaller formats and
+// decoded back to floats as each vertex is fetched for the vertex shader:
+//   float32 - stored as is
+//   float16 - IEEE half float
+//   unorm8, unorm16 - [0,1] mapped to the full range of an unsigned integer
+//   snorm8, snorm16 - [-1,1] mapped to the range of a signed integer, as in
+//                     OpenGL (the most negative integer also decodes to -1)
+// Values outside of a normalized format's range are clamped when encoded.
+enum class attrib_format {float32, float16, unorm8, unorm16, snorm8, snorm16};
+
+// The storage of a vertex: a sequence of attributes, each a run of count
+// floats in one format, packed in order without padding into stride bytes.
+struct vertex_layout
+{
+    struct attribute
+    {
+        attrib_format format = attrib_format::float32;
+        int count = 0;
+        int offset = 0;
+    };
+    attribute attributes[MAX_FLOATS_PER_VERTEX];
+    int num_attributes = 0;
+
+    // Floats described, and bytes per vertex.
+    int floats = 0;
+    int stride = 0;
+
+    // Whether anything is stored in a format other than float32.  Layouts that
+    // are not packed store vertices as plain floats.
+    bool packed() const;
+};
+
+// Append an attribute to layout, named as in WebGPU: the format followed by
+// "x" and the number of floats, such as "float16x3" or "unorm8x4", or just the
+// format for a single float.  Returns false if the name is not valid or the
+// layout would exceed MAX_FLOATS_PER_VERTEX floats.
+bool add_attribute(vertex_layout& layout, const std::string& name);
+
+// Encode the layout.floats floats of one vertex into layout.stride bytes.
+void encode_vertex(const vertex_layout& layout, const float* in, unsigned char* out);
+
+// Decode count consecutive vertices, starting at packed, into count*layout.floats
+// floats at out.  Each attribute is decoded for all of the vertices in a loop
+// of its own, so the choice of format is made once per attribute rather than
+// once per float.  With SSE2 the integer formats are widened and converted
+// four floats at a time, and with F16C so are halves; the results are the
+// same as the scalar conversions.
+void decode_vertices(const vertex_layout& layout, const unsigned char* packed, int count, float* out);
+
+#endif